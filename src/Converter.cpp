@@ -1,5 +1,4 @@
 #include "Converter.h"
-#include "old/Keys.h"
 #include <cstring>
 #include <filesystem>
 #include <iostream>
@@ -10,8 +9,6 @@ Converter::Converter(Utils::Flags flag)
     , m_high_compression_flag(flag.high_compression)
     , m_server_flag(flag.server)
 {
-    m_gms_key.load(key_gms);
-    m_kms_key.load(key_kms);
 }
 Converter::~Converter()
 {
@@ -19,8 +16,7 @@ Converter::~Converter()
 
 void Converter::load_file(std::string filename)
 {
-    File file = File(filename);
-    m_file = &file;
+    m_file.emplace(filename);
 }
 
 void Converter::convert(std::string filename)
@@ -29,17 +25,17 @@ void Converter::convert(std::string filename)
     this->load_file(filename);
     if (path.extension() == ".img") {
         std::cout << "This is a .img file." << std::endl;
-        this->convert_img(filename);
+        this->convert_img(*m_file);
     } else if (path.extension() == ".wz") {
         std::cout << "This is a .wz file." << std::endl;
-        this->convert_wz(filename);
+        this->convert_wz(*m_file);
     }
 }
 
-void Converter::convert_wz(File file)
+void Converter::convert_wz(File& file)
 {
 }
 
-void Converter::convert_img(File file)
+void Converter::convert_img(File& file)
 {
 }
@@ -3,33 +3,22 @@
 #include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <optional>
 #include <string>
 #include <sys/types.h>
 
 #include "File.h"
 #include "Utils.h"
 
-#define MAGIC_KEY_LENGTH 65536
-
 class Converter {
-    struct Key {
-        int length = 0;
-        key_t* data = new key_t[MAGIC_KEY_LENGTH];
-
-        void load(uint8_t* input)
-        {
-            std::copy(input, input + MAGIC_KEY_LENGTH, data);
-        }
-    };
-
 public:
     Converter(Utils::Flags);
     ~Converter();
     void convert(std::string);
 
 private:
-    void convert_img(File);
-    void convert_wz(File);
+    void convert_img(File&);
+    void convert_wz(File&);
 
     void load_file(std::string);
 
@@ -37,10 +26,7 @@ private:
     bool m_high_compression_flag = false;
     bool m_server_flag = false;
 
-    File* m_file;
-
-    Key m_gms_key = *new Key { MAGIC_KEY_LENGTH };
-    Key m_kms_key = *new Key { MAGIC_KEY_LENGTH };
+    std::optional<File> m_file;
 };
 
 #endif // CONVERTER_H_
@@ -1,18 +1,64 @@
 #include "File.h"
-#include <filesystem>
-#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <utility>
 
 File::File(std::string filename)
+    : m_filename(std::move(filename))
 {
-
-    m_file = fopen(filename.c_str(), "r");
+    m_fd = open(m_filename.c_str(), O_RDONLY);
+    if (m_fd == -1)
+        throw std::runtime_error("Failed to open file " + m_filename);
     struct stat st;
-    stat(filename.c_str(), &st);
+    if (fstat(m_fd, &st) == -1) {
+        close();
+        throw std::runtime_error("Failed to obtain file information of file " + m_filename);
+    }
     m_size = st.st_size;
-
-    std::cerr << m_size << std::endl;
+    // mmap refuses empty mappings, an empty file just has no data
+    if (m_size == 0)
+        return;
+    auto data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+    if (data == MAP_FAILED) {
+        close();
+        throw std::runtime_error("Failed to create memory mapping of file " + m_filename);
+    }
+    m_data = static_cast<const uint8_t*>(data);
 }
 
 File::~File()
 {
+    close();
+}
+
+File::File(File&& other) noexcept
+    : m_fd(std::exchange(other.m_fd, -1))
+    , m_data(std::exchange(other.m_data, nullptr))
+    , m_filename(std::move(other.m_filename))
+    , m_size(std::exchange(other.m_size, 0))
+    , m_offset(std::exchange(other.m_offset, 0))
+{
+}
+
+File& File::operator=(File&& other) noexcept
+{
+    if (this != &other) {
+        close();
+        m_fd = std::exchange(other.m_fd, -1);
+        m_data = std::exchange(other.m_data, nullptr);
+        m_filename = std::move(other.m_filename);
+        m_size = std::exchange(other.m_size, 0);
+        m_offset = std::exchange(other.m_offset, 0);
+    }
+    return *this;
+}
+
+void File::close()
+{
+    if (m_data)
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+    if (m_fd != -1)
+        ::close(m_fd);
+    m_data = nullptr;
+    m_fd = -1;
 }
@@ -3,31 +3,86 @@
 
 #include "Utils.h"
 
+#include <cstdint>
 #include <cstring>
-#include <fstream>
+#include <span>
+#include <stdexcept>
 #include <string>
 #include <sys/stat.h>
 #include <unistd.h>
 
+// Read-only memory mapped input with a cursor. Reads never go past the end of the mapping.
 class File {
 public:
-    File(std::string);
+    explicit File(std::string);
     ~File();
 
-    void operator=(const File other)
+    File(File&&) noexcept;
+    File& operator=(File&&) noexcept;
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+
+    const uint8_t* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    const std::string& filename() const { return m_filename; }
+
+    size_t tell() const { return m_offset; }
+    size_t remaining() const { return m_size - m_offset; }
+    void seek(size_t offset)
+    {
+        check(offset, 0);
+        m_offset = offset;
+    }
+    void skip(size_t count)
     {
-        memcpy((void*)this, (void*)&other, other.size());
+        check(m_offset, count);
+        m_offset += count;
     }
 
-    FILE* data() { return m_file; }
+    template <typename T>
+    T read()
+    {
+        check(m_offset, sizeof(T));
+        T value;
+        std::memcpy(&value, m_data + m_offset, sizeof(T));
+        m_offset += sizeof(T);
+        return value;
+    }
+    // WZ compressed int: one signed byte, or -128 followed by the full 32 bits
+    int32_t read_cint()
+    {
+        auto a = read<int8_t>();
+        return a != -128 ? a : read<int32_t>();
+    }
 
-    size_t size() { return m_size; }
-    const size_t size() const { return m_size; }
+    // Bytes [offset, offset + count) of the file, without moving the cursor
+    std::span<const uint8_t> view(size_t offset, size_t count) const
+    {
+        check(offset, count);
+        return { m_data + offset, count };
+    }
+    // The next count bytes, moving the cursor past them
+    std::span<const uint8_t> read_span(size_t count)
+    {
+        auto span = view(m_offset, count);
+        m_offset += count;
+        return span;
+    }
 
 private:
-    FILE* m_file = nullptr;
+    void check(size_t offset, size_t count) const
+    {
+        if (offset > m_size || count > m_size - offset)
+            throw std::out_of_range(m_filename + ": reading " + std::to_string(count)
+                + " bytes at " + std::to_string(offset) + " goes past the end");
+    }
+    void close();
+
+    int m_fd = -1;
+    const uint8_t* m_data = nullptr;
     std::string m_filename;
 
     size_t m_size { 0 };
+    size_t m_offset { 0 };
 };
 #endif // FILE_H_
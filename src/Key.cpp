@@ -0,0 +1,280 @@
+#include "Key.h"
+
+#include <cstring>
+#include <map>
+#include <memory>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC lets any function use the AES instructions
+#define KEY_TARGET_AES
+#else
+#define KEY_TARGET_AES __attribute__((target("aes,sse2")))
+#endif
+#define KEY_HAVE_AESNI
+#endif
+
+namespace {
+
+// Every fourth byte of the 128 byte user key, which is all the client ever used of it
+constexpr uint8_t user_key[32] = {
+    0x13, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0xB4, 0x00, 0x00, 0x00,
+    0x1B, 0x00, 0x00, 0x00, 0x0F, 0x00, 0x00, 0x00, 0x33, 0x00, 0x00, 0x00, 0x52, 0x00, 0x00, 0x00
+};
+
+constexpr uint8_t sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+constexpr int rounds = 14;
+
+using RoundKeys = std::array<uint8_t, 16 * (rounds + 1)>;
+
+RoundKeys expand_key()
+{
+    RoundKeys w {};
+    std::memcpy(w.data(), user_key, sizeof(user_key));
+    uint8_t rcon = 0x01;
+    for (size_t i = 8; i < 4 * (rounds + 1); ++i) {
+        uint8_t t[4];
+        std::memcpy(t, &w[(i - 1) * 4], 4);
+        if (i % 8 == 0) {
+            uint8_t first = t[0];
+            t[0] = sbox[t[1]] ^ rcon;
+            t[1] = sbox[t[2]];
+            t[2] = sbox[t[3]];
+            t[3] = sbox[first];
+            rcon = static_cast<uint8_t>((rcon << 1) ^ (rcon & 0x80 ? 0x1b : 0));
+        } else if (i % 8 == 4) {
+            for (auto& b : t)
+                b = sbox[b];
+        }
+        for (size_t j = 0; j < 4; ++j)
+            w[i * 4 + j] = w[(i - 8) * 4 + j] ^ t[j];
+    }
+    return w;
+}
+
+const RoundKeys& round_keys()
+{
+    static const RoundKeys keys = expand_key();
+    return keys;
+}
+
+uint8_t xtime(uint8_t b)
+{
+    return static_cast<uint8_t>((b << 1) ^ (b & 0x80 ? 0x1b : 0));
+}
+
+void encrypt_portable(uint8_t* block, size_t count, uint8_t* out)
+{
+    auto& rk = round_keys();
+    uint8_t s[16];
+    std::memcpy(s, block, 16);
+    for (size_t n = 0; n < count; ++n) {
+        for (size_t i = 0; i < 16; ++i)
+            s[i] ^= rk[i];
+        for (int r = 1; r <= rounds; ++r) {
+            uint8_t t[16];
+            // SubBytes and ShiftRows
+            for (size_t c = 0; c < 4; ++c)
+                for (size_t row = 0; row < 4; ++row)
+                    t[c * 4 + row] = sbox[s[((c + row) % 4) * 4 + row]];
+            if (r != rounds) {
+                for (size_t c = 0; c < 4; ++c) {
+                    auto col = t + c * 4;
+                    uint8_t a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+                    uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+                    col[0] ^= all ^ xtime(a0 ^ a1);
+                    col[1] ^= all ^ xtime(a1 ^ a2);
+                    col[2] ^= all ^ xtime(a2 ^ a3);
+                    col[3] ^= all ^ xtime(a3 ^ a0);
+                }
+            }
+            for (size_t i = 0; i < 16; ++i)
+                s[i] = t[i] ^ rk[r * 16 + i];
+        }
+        std::memcpy(out + n * 16, s, 16);
+    }
+    std::memcpy(block, s, 16);
+}
+
+#ifdef KEY_HAVE_AESNI
+KEY_TARGET_AES void encrypt_aesni(uint8_t* block, size_t count, uint8_t* out)
+{
+    auto& rk = round_keys();
+    __m128i k[rounds + 1];
+    for (int r = 0; r <= rounds; ++r)
+        k[r] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rk.data() + r * 16));
+    auto s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block));
+    for (size_t n = 0; n < count; ++n) {
+        s = _mm_xor_si128(s, k[0]);
+        for (int r = 1; r < rounds; ++r)
+            s = _mm_aesenc_si128(s, k[r]);
+        s = _mm_aesenclast_si128(s, k[rounds]);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + n * 16), s);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(block), s);
+}
+
+bool cpu_has_aes()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] >> 25) & 1;
+#else
+    return __builtin_cpu_supports("aes");
+#endif
+}
+#endif
+
+// Encrypts block count times in a chain, writing every result to out
+void encrypt_chain(uint8_t* block, size_t count, uint8_t* out)
+{
+#ifdef KEY_HAVE_AESNI
+    static const bool aesni = cpu_has_aes();
+    if (aesni)
+        return encrypt_aesni(block, count, out);
+#endif
+    encrypt_portable(block, count, out);
+}
+
+size_t page_size()
+{
+#ifdef _WIN32
+    static const size_t size = [] {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return static_cast<size_t>(info.dwPageSize);
+    }();
+#else
+    static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    return size;
+}
+
+// Address space nothing can touch yet, nullptr when there is none
+uint8_t* reserve(size_t length)
+{
+#ifdef _WIN32
+    return static_cast<uint8_t*>(VirtualAlloc(nullptr, length, MEM_RESERVE, PAGE_NOACCESS));
+#else
+    void* data = mmap(nullptr, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return data == MAP_FAILED ? nullptr : static_cast<uint8_t*>(data);
+#endif
+}
+
+void release(uint8_t* data, size_t length)
+{
+#ifdef _WIN32
+    (void)length;
+    VirtualFree(data, 0, MEM_RELEASE);
+#else
+    munmap(data, length);
+#endif
+}
+
+// Reserved pages that have not been written yet read as zero once they are writable
+bool make_writable(uint8_t* data, size_t length)
+{
+#ifdef _WIN32
+    return VirtualAlloc(data, length, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    return mprotect(data, length, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+bool make_read_only(uint8_t* data, size_t length)
+{
+#ifdef _WIN32
+    DWORD old;
+    return VirtualProtect(data, length, PAGE_READONLY, &old) != 0;
+#else
+    return mprotect(data, length, PROT_READ) == 0;
+#endif
+}
+
+}
+
+Key& Key::get(IV iv)
+{
+    static std::mutex mutex;
+    static std::map<IV, std::unique_ptr<Key>> keys;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& key = keys[iv];
+    if (!key)
+        key.reset(new Key(iv));
+    return *key;
+}
+
+Key::Key(IV iv)
+    : m_iv(iv)
+{
+    // Reserve the whole key up front so its address never changes, pages are made readable
+    // as they get generated
+    m_data = reserve(max_length);
+    if (!m_data)
+        throw std::runtime_error("Failed to reserve memory for a key");
+    for (size_t i = 0; i < m_block.size(); ++i)
+        m_block[i] = iv[i % iv.size()];
+}
+
+Key::~Key()
+{
+    release(m_data, max_length);
+}
+
+const uint8_t* Key::data(size_t length)
+{
+    if (m_length.load(std::memory_order_acquire) < length)
+        generate(length);
+    return m_data;
+}
+
+void Key::generate(size_t length)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto done = m_length.load(std::memory_order_relaxed);
+    if (done >= length)
+        return;
+    if (length > max_length)
+        throw std::runtime_error("Key length past " + std::to_string(max_length) + " requested");
+    auto end = std::min(max_length, (length + page_size() - 1) / page_size() * page_size());
+    auto begin = m_data + done;
+    if (!make_writable(begin, end - done))
+        throw std::runtime_error("Failed to make key memory writable");
+    // An all zero IV means the data is not encrypted at all, and the fresh pages are zero already
+    if (m_iv != bms_iv)
+        encrypt_chain(m_block.data(), (end - done) / 16, begin);
+    if (!make_read_only(begin, end - done))
+        throw std::runtime_error("Failed to make key memory read-only");
+    m_length.store(end, std::memory_order_release);
+}
@@ -0,0 +1,48 @@
+#ifndef KEY_H_
+#define KEY_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// WZ keystream, generated with AES from a 4 byte IV instead of being shipped as tables.
+// Keys are shared process-wide and only grow as far as somebody has asked for.
+class Key {
+public:
+    using IV = std::array<uint8_t, 4>;
+
+    static constexpr IV bms_iv { 0x00, 0x00, 0x00, 0x00 };
+    static constexpr IV gms_iv { 0x4D, 0x23, 0xC7, 0x2B };
+    static constexpr IV kms_iv { 0xB9, 0x7D, 0x63, 0xE9 };
+
+    // Lua scripts are decrypted with up to 0x20000 bytes of key
+    static constexpr size_t max_length = 0x20000;
+
+    // The key for iv, shared by every caller asking for the same IV
+    static Key& get(IV iv);
+
+    // Makes sure the first length bytes are generated and returns the whole key. Bytes past
+    // length may not be readable yet. The memory is read-only.
+    const uint8_t* data(size_t length = max_length);
+
+    IV iv() const { return m_iv; }
+
+    Key(const Key&) = delete;
+    Key& operator=(const Key&) = delete;
+    ~Key();
+
+private:
+    explicit Key(IV);
+
+    void generate(size_t length);
+
+    IV m_iv;
+    uint8_t* m_data = nullptr;
+    std::array<uint8_t, 16> m_block {};
+    std::atomic<size_t> m_length { 0 };
+    std::mutex m_mutex;
+};
+
+#endif // KEY_H_
@@ -18,7 +18,8 @@ int main(int argc, char* argv[])
     std::vector<std::filesystem::path> files;
     Utils::Flags flags;
 
-    while (int arguments = getopt(argc, argv, "csh") != -1) {
+    int arguments;
+    while ((arguments = getopt(argc, argv, "csh")) != -1) {
         switch (arguments) {
         case 's':
             flags.server = true;
@@ -33,12 +34,9 @@ int main(int argc, char* argv[])
         }
     }
 
-    // this is to skip over the command-line flags
-    for (auto& argument : std::vector<std::string>(argv + 1, argv + argc)) {
-        if (argument[0] == '-')
-            continue;
+    // getopt leaves the files after the flags
+    for (auto& argument : std::vector<std::string>(argv + optind, argv + argc))
         files.emplace_back(argument);
-    }
 
     auto converter = Converter { flags };
 
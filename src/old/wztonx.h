@@ -22,27 +22,49 @@
 #define NOMINMAX
 #include <Windows.h>
 #else
+#include <dirent.h>
 #include <sys/fcntl.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #endif
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
 
 #include <lz4.h>
 #include <lz4hc.h>
 #include <zlib.h>
+#ifdef NL_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
 
 #include <squish.h>
 
+#include "../Key.h"
+
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
 #ifndef NL_NO_CODECVT
 #include <codecvt>
 #endif
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <exception>
 #ifndef NL_NO_STD_FILESYSTEM
 #include <filesystem>
 namespace sys = std::experimental::filesystem;
@@ -51,14 +73,24 @@ namespace sys = std::experimental::filesystem;
 namespace sys = boost::filesystem;
 #endif
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <list>
 #include <locale>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <numeric>
+#include <random>
 #include <regex>
+#include <set>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -82,12 +114,9 @@ typedef char char8_t;
 typedef uint32_t id_t;
 typedef uint8_t key_t;
 typedef int32_t int_t;
-// The keys
-// TODO - Use AES to generate these keys at runtime
-extern key_t key_bms[65536];
-extern key_t key_gms[65536];
-extern key_t key_kms[65536];
-key_t const* keys[3] = { key_bms, key_gms, key_kms };
+// The keys to try, generated as they get used. More can be added for custom IVs.
+std::vector<::Key*> keys = { &::Key::get(::Key::bms_iv), &::Key::get(::Key::gms_iv),
+    &::Key::get(::Key::kms_iv) };
 // Tables for color lookups
 uint8_t const table4[0x10] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
     0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF };
@@ -131,6 +160,35 @@ struct identity {
     T const& operator()(T const& v) const { return v; }
 };
 
+// MurmurHash64A. Lengths that are a multiple of 8 can be hashed in pieces, seeding each piece
+// with the hash of the ones before it.
+inline uint64_t hash64(void const* data, size_t length, uint64_t seed)
+{
+    constexpr uint64_t m = 0xc6a4a7935bd1e995ull;
+    constexpr int r = 47;
+    auto p = static_cast<uint8_t const*>(data);
+    auto h = seed ^ (length * m);
+    for (; length >= 8; p += 8, length -= 8) {
+        uint64_t k;
+        std::memcpy(&k, p, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    if (length) {
+        uint64_t k = 0;
+        std::memcpy(&k, p, length);
+        h ^= k;
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
 template <int N>
 void scale(std::vector<uint8_t> const& input, std::vector<uint8_t>& output, int width, int height)
 {
@@ -149,14 +207,464 @@ void scale(std::vector<uint8_t> const& input, std::vector<uint8_t>& output, int
         }
     }
 }
-// Input memory mapped file
-struct imapfile {
+// Where progress goes. Files converted side by side in batch mode each collect theirs and print
+// it in one piece once done.
+thread_local std::ostream* progress = &std::cout;
+// Serializes writes to another stream buffer, for the log every thread writes to
+struct locked_buf : std::streambuf {
+    std::streambuf* target;
+    std::mutex mutex;
+    explicit locked_buf(std::streambuf* target)
+        : target(target)
+    {
+    }
+    int_type overflow(int_type c) override
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+        if (traits_type::eq_int_type(c, traits_type::eof()))
+            return traits_type::not_eof(c);
+        return target->sputc(traits_type::to_char_type(c));
+    }
+    std::streamsize xsputn(char const* s, std::streamsize n) override
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+        return target->sputn(s, n);
+    }
+    int sync() override
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+        return target->pubsync();
+    }
+};
+// Time and page faults spent on one step, printed in place of a plain "Done!"
+struct phase {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::pair<long, long> start_faults = faults();
+    static std::pair<long, long> faults()
+    {
+#ifndef _WIN32
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return { usage.ru_majflt, usage.ru_minflt };
+#else
+        return { 0, 0 };
+#endif
+    }
+    void done()
+    {
+        auto end = faults();
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start)
+                      .count();
+        *progress << "Done! " << ms << " ms, " << end.first - start_faults.first << " major/"
+                  << end.second - start_faults.second << " minor faults" << std::endl;
+    }
+};
+// Malformed input, with the offset into the file where it was noticed
+struct wz_error : std::runtime_error {
+    size_t offset;
+    wz_error(std::string const& what, size_t offset)
+        : std::runtime_error(what + " at " + std::to_string(offset))
+        , offset(offset)
+    {
+    }
+};
+// Threads shared by every file being converted. Work is queued in small pieces, imgs and batches
+// of bitmaps, so one big file never leaves the others idle. A thread waiting for its tasks runs
+// queued ones meanwhile, and the thread that made the pool counts towards the budget.
+struct task_pool {
+    std::mutex mutex;
+    std::condition_variable wake;
+    // Parts of files go before whole files, so that started files finish first
+    std::deque<std::function<void()>> work, files;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+    explicit task_pool(unsigned budget)
+    {
+        for (auto i = 1u; i < budget; ++i)
+            threads.emplace_back([this] {
+                while (run_one(true, true)) { }
+            });
+    }
+    task_pool(task_pool const&) = delete;
+    ~task_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock { mutex };
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads)
+            t.join();
+    }
+    void push(std::function<void()> f, bool file = false)
+    {
+        {
+            std::lock_guard<std::mutex> lock { mutex };
+            (file ? files : work).push_back(std::move(f));
+        }
+        wake.notify_all();
+    }
+    // Runs a queued task. Only the pool's own threads block for one to come along, and
+    // returning false tells them to stop.
+    bool run_one(bool take_files, bool block)
+    {
+        std::function<void()> f;
+        {
+            std::unique_lock<std::mutex> lock { mutex };
+            auto ready = [&] { return !work.empty() || (take_files && !files.empty()); };
+            if (block)
+                wake.wait(lock, [&] { return stopping || ready(); });
+            if (!ready())
+                return false;
+            auto& queue = work.empty() ? files : work;
+            f = std::move(queue.front());
+            queue.pop_front();
+        }
+        f();
+        return true;
+    }
+};
+// Tasks that are waited for together
+struct task_group {
+    task_pool& pool;
+    std::atomic<size_t> pending { 0 };
+    std::exception_ptr error;
+    explicit task_group(task_pool& pool)
+        : pool(pool)
+    {
+    }
+    void run(std::function<void()> f, bool file = false)
+    {
+        ++pending;
+        pool.push([this, f = std::move(f)] {
+            try {
+                f();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock { pool.mutex };
+                if (!error)
+                    error = std::current_exception();
+            }
+            // Under the lock, so a waiter can't miss it between checking and sleeping
+            std::lock_guard<std::mutex> lock { pool.mutex };
+            --pending;
+            pool.wake.notify_all();
+        },
+            file);
+    }
+    void wait(bool take_files = false)
+    {
+        for (;;) {
+            if (pool.run_one(take_files, false))
+                continue;
+            std::unique_lock<std::mutex> lock { pool.mutex };
+            pool.wake.wait(lock, [&] {
+                return pending == 0 || !pool.work.empty() || (take_files && !pool.files.empty());
+            });
+            if (pending == 0)
+                break;
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+// Input read through a few mapped windows instead of one mapping of the whole file, for inputs
+// bigger than the memory or address space we may use. Pipes can be neither mapped nor read
+// twice, so they are spooled to an unlinked temporary file first. Windows are shared by every
+// cursor, and the least recently used ones are unmapped once the budget is used up. Windows a
+// cursor still stands in are kept, so the budget can be overrun by one window per thread.
+// Several files can be opened as one, one after the other, for archives split into parts.
+struct window_source {
+    struct window {
+        size_t start = 0;
+        size_t size = 0;
+        char const* data = nullptr;
+        window(int file_handle, size_t file_offset, size_t start, size_t size)
+            : start(start)
+            , size(size)
+        {
+#ifndef _WIN32
+            auto p = mmap(nullptr, size, PROT_READ, MAP_SHARED, file_handle, static_cast<off_t>(file_offset));
+            if (p == MAP_FAILED)
+                throw std::runtime_error("Failed to map a window of the input");
+            data = reinterpret_cast<char const*>(p);
+#else
+            (void)file_handle;
+            (void)file_offset;
+#endif
+        }
+        window(window const&) = delete;
+        ~window()
+        {
+#ifndef _WIN32
+            munmap(const_cast<char*>(data), size);
+#endif
+        }
+    };
+    // One of the files, taking up [start, start + size) of the input
+    struct part {
+        int file_handle;
+        size_t start;
+        size_t size;
+    };
+    // Windows overlap by this much, so reads up to that size always fit in a single window.
+    // Bigger ones, like canvases and sounds, get a window of their own.
+    static constexpr size_t window_size = 0x400000, overlap = 0x100000;
+    // Used for pipes when no budget is given
+    static constexpr size_t default_budget = size_t { 256 } << 20;
+    std::vector<part> parts;
+    size_t file_size = 0;
+    size_t budget = 0;
+    size_t used = 0;
+    std::mutex mutex;
+    std::list<std::shared_ptr<window const>> windows;
+    window_source() = default;
+    window_source(window_source const&) = delete;
+#ifdef _WIN32
+    void open(std::vector<std::string> const&, size_t)
+    {
+        throw std::runtime_error("Windowed input is not supported on Windows");
+    }
+    void prefetch(size_t, size_t) { }
+#else
+    void open(std::vector<std::string> const& paths, size_t memory)
+    {
+        budget = memory ? memory : default_budget;
+        for (auto& p : paths) {
+            auto file_handle = ::open(p.c_str(), O_RDONLY);
+            if (file_handle == -1)
+                throw std::runtime_error("Failed to open file " + p);
+            parts.push_back({ file_handle, file_size, 0 });
+            struct stat finfo;
+            if (fstat(file_handle, &finfo) == -1)
+                throw std::runtime_error("Failed to obtain file information of file " + p);
+            if (S_ISREG(finfo.st_mode))
+                parts.back().size = static_cast<size_t>(finfo.st_size);
+            else
+                spool(p, parts.back());
+            file_size += parts.back().size;
+        }
+    }
+    void spool(std::string const& p, part& to)
+    {
+        auto dir = std::getenv("TMPDIR");
+        auto name = std::string { dir ? dir : "/tmp" } + "/wztonx.XXXXXX";
+        auto spool_handle = mkstemp(&name[0]);
+        if (spool_handle == -1)
+            throw std::runtime_error("Failed to create a temporary file to spool " + p);
+        unlink(name.c_str());
+        std::vector<char> buf(0x100000);
+        for (;;) {
+            auto n = ::read(to.file_handle, buf.data(), buf.size());
+            if (n == 0)
+                break;
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1)
+                throw std::runtime_error("Failed to read from " + p);
+            for (auto done = ssize_t { 0 }; done < n;) {
+                auto w = ::write(spool_handle, buf.data() + done, static_cast<size_t>(n - done));
+                if (w == -1 && errno == EINTR)
+                    continue;
+                if (w == -1)
+                    throw std::runtime_error("Failed to spool " + p + " to a temporary file");
+                done += w;
+            }
+            to.size += static_cast<size_t>(n);
+        }
+        close(to.file_handle);
+        to.file_handle = spool_handle;
+    }
+    ~window_source()
+    {
+        windows.clear();
+        for (auto& pt : parts)
+            close(pt.file_handle);
+    }
+    void prefetch(size_t n, size_t length)
+    {
+        if (n >= file_size)
+            return;
+        auto& pt = part_at(n);
+        posix_fadvise(pt.file_handle, static_cast<off_t>(n - pt.start), static_cast<off_t>(length), POSIX_FADV_WILLNEED);
+    }
+#endif
+    part const& part_at(size_t n) const
+    {
+        return *std::prev(std::upper_bound(parts.begin(), parts.end(), n,
+            [](size_t n, part const& pt) { return n < pt.start; }));
+    }
+    // A window holding [n, n + length), which the caller has checked to be inside the input
+    std::shared_ptr<window const> fetch(size_t n, size_t length)
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+        for (auto it = windows.begin(); it != windows.end(); ++it) {
+            auto& w = **it;
+            if (w.start <= n && n + length <= w.start + w.size) {
+                windows.splice(windows.begin(), windows, it);
+                return windows.front();
+            }
+        }
+        auto& pt = part_at(n);
+        if (n + length > pt.start + pt.size)
+            throw wz_error("Read runs past the end of a part", n);
+        size_t start, size;
+        if (length <= overlap) {
+            start = pt.start + (n - pt.start) / window_size * window_size;
+            size = std::min(window_size + overlap, pt.start + pt.size - start);
+        } else {
+#ifndef _WIN32
+            static auto const page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            start = pt.start + ((n - pt.start) & ~(page - 1));
+#else
+            start = n;
+#endif
+            size = n + length - start;
+        }
+        for (auto it = windows.end(); used + size > budget && it != windows.begin();) {
+            --it;
+            if (it->use_count() == 1) {
+                used -= (*it)->size;
+                it = windows.erase(it);
+            }
+        }
+        windows.push_front(std::make_shared<window const>(pt.file_handle, start - pt.start, start, size));
+        used += size;
+        return windows.front();
+    }
+};
+#ifndef _WIN32
+// The permissions a file created with 0644 gets. The umask can only be read by changing it,
+// so that is done just once, leaving threads that create files nothing to race on.
+inline mode_t new_file_mode()
+{
+    static auto const mode = [] {
+        auto mask = ::umask(0);
+        ::umask(mask);
+        return static_cast<mode_t>((S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) & ~mask);
+    }();
+    return mode;
+}
+#endif
+// Read cursor over the input. Copies share the mapping, so every thread can have its own.
+struct icursor {
     char const* base = nullptr;
     char const* offset = nullptr;
+    // What is mapped at the moment, reads outside of it go through refill
+    char const* first = nullptr;
+    char const* limit = nullptr;
+    size_t file_size = 0;
+    // End of the region being read, see enter
+    size_t end = 0;
+    // Only set when the input is read through windows
+    window_source* source = nullptr;
+    std::shared_ptr<window_source::window const> window;
+    size_t tell()
+    {
+        return static_cast<size_t>(offset - base);
+    }
+    size_t size() { return file_size; }
+    size_t remaining() { return tell() < end ? end - tell() : 0; }
+    // Asks the kernel to start reading [n, n + length) in before we get there
+    void prefetch(size_t n, size_t length)
+    {
+#ifndef _WIN32
+        if (n >= file_size)
+            return;
+        length = std::min(length, file_size - n);
+        if (source) {
+            source->prefetch(n, length);
+            return;
+        }
+        static auto const page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        auto first = n & ~(page - 1);
+        madvise(const_cast<char*>(base) + first, n + length - first, MADV_WILLNEED);
+#endif
+    }
+    void seek(size_t n)
+    {
+        offset = base + n;
+        // Makes the next read map the window it needs
+        if (offset < first)
+            limit = offset;
+    }
+    void skip(size_t n) { offset += n; }
+    // Reads stop at whichever comes first of the mapping and the region
+    void clamp()
+    {
+        // Windowed input has nothing mapped before the first read, which has to map a window
+        if (source)
+            limit = window ? window->data + window->size : offset;
+        else
+            limit = base + file_size;
+        limit = std::min(limit, base + end);
+        // Seeking before the window has to keep making the next read map another one
+        if (offset < first)
+            limit = offset;
+    }
+    // Checks once that the n bytes a header declares fit in the region it is in, and confines
+    // reads to them. The only check left per read is the comparison with limit, which is
+    // needed for windows anyway. Returns what to hand to leave afterwards.
+    size_t enter(size_t n)
+    {
+        auto pos = tell();
+        if (pos > end || n > end - pos)
+            throw wz_error("Declared size " + std::to_string(n) + " runs past the end of the "
+                    + (end == file_size ? "file" : "enclosing region"),
+                pos);
+        auto outer = end;
+        end = pos + n;
+        clamp();
+        return outer;
+    }
+    void leave(size_t outer)
+    {
+        end = outer;
+        clamp();
+    }
+    // Makes the n bytes at the cursor available in one piece
+    void refill(size_t n)
+    {
+        auto pos = tell();
+        if (pos > end || n > end - pos)
+            throw wz_error(end == file_size ? "Unexpected end of file" : "Read past the end of the region", pos);
+        if (!source)
+            return;
+        window = source->fetch(pos, n);
+        base = window->data - window->start;
+        first = window->data;
+        offset = base + pos;
+        clamp();
+    }
+    // The n bytes at the cursor, which stay valid until the cursor moves to another window
+    char const* view(size_t n)
+    {
+        if (limit - offset < static_cast<ptrdiff_t>(n))
+            refill(n);
+        auto p = offset;
+        offset += n;
+        return p;
+    }
+    // Nothing in the format is aligned, so values are copied out rather than dereferenced
+    template <typename T>
+    T read()
+    {
+        T v;
+        std::memcpy(&v, view(sizeof(T)), sizeof(T));
+        return v;
+    }
+    int32_t read_cint()
+    {
+        int8_t a = read<int8_t>();
+        return a != -128 ? a : read<int32_t>();
+    }
+};
+// Input memory mapped file
+struct imapfile : icursor {
 #ifdef _WIN32
     void* file_handle = nullptr;
     void* map_handle = nullptr;
-    void open(std::string p)
+    void open(std::string p, bool = false)
     {
         file_handle = CreateFileA(p.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
             FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
@@ -168,18 +676,29 @@ struct imapfile {
         base = reinterpret_cast<char*>(MapViewOfFile(map_handle, FILE_MAP_READ, 0, 0, 0));
         if (base == nullptr)
             throw std::runtime_error("Failed to map view of file " + p);
-        offset = base;
+        LARGE_INTEGER finfo;
+        if (!GetFileSizeEx(file_handle, &finfo))
+            throw std::runtime_error("Failed to obtain file information of file " + p);
+        file_size = static_cast<size_t>(finfo.QuadPart);
+        offset = first = base;
+        limit = base + file_size;
+        end = file_size;
     }
     ~imapfile()
     {
+        if (base == nullptr)
+            return;
         UnmapViewOfFile(base);
         CloseHandle(map_handle);
         CloseHandle(file_handle);
     }
+    void advise_sequential() { }
+    void advise_random() { }
 #else
-    int file_handle = 0;
-    size_t file_size = 0;
-    void open(std::string p)
+    int file_handle = -1;
+    // Files up to this size are read in completely when mapped with populate
+    static constexpr size_t populate_limit = size_t { 256 } << 20;
+    void open(std::string p, bool populate = false)
     {
         file_handle = ::open(p.c_str(), O_RDONLY);
         if (file_handle == -1)
@@ -188,108 +707,503 @@ struct imapfile {
         if (fstat(file_handle, &finfo) == -1)
             throw std::runtime_error("Failed to obtain file information of file " + p);
         file_size = finfo.st_size;
+        auto flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+        if (populate && file_size <= populate_limit)
+            flags |= MAP_POPULATE;
+#endif
         base = reinterpret_cast<char const*>(
-            mmap(nullptr, file_size, PROT_READ, MAP_SHARED, file_handle, 0));
+            mmap(nullptr, file_size, PROT_READ, flags, file_handle, 0));
         if (reinterpret_cast<intptr_t>(base) == -1)
             throw std::runtime_error("Failed to create memory mapping of file " + p);
-        offset = base;
+        offset = first = base;
+        limit = base + file_size;
+        end = file_size;
     }
     ~imapfile()
     {
+        if (file_handle == -1)
+            return;
         munmap(const_cast<char*>(base), file_size);
         close(file_handle);
     }
+    // The directories and imgs are walked front to back
+    void advise_sequential() { madvise(const_cast<char*>(base), file_size, MADV_SEQUENTIAL); }
+    // Bitmaps and audio jump around, what is needed gets prefetched instead
+    void advise_random() { madvise(const_cast<char*>(base), file_size, MADV_RANDOM); }
 #endif
-    size_t tell()
+};
+#ifdef __linux__
+// Output written with io_uring instead of through a shared mapping. Finished data is handed to
+// the kernel in large writes as it is produced, with a bounded number in flight, so dirty page
+// writeback never stalls the converter. Only the ring setup and the two queues are needed,
+// which is little enough to not depend on liburing for.
+struct uring_writer {
+    static constexpr size_t chunk_size = 0x100000;
+    static constexpr unsigned depth = 8;
+    // O_DIRECT wants offsets, lengths and addresses in multiples of this
+    static constexpr size_t align = 0x1000;
+    struct buffer {
+        char* data = nullptr;
+        // File offset of data[0]
+        size_t offset = 0;
+        bool busy = false;
+        // What was submitted, in case the write comes back short
+        int handle = -1;
+        size_t first = 0, length = 0;
+    };
+    // A run of output gathered in one buffer, file offsets [first, pos) are filled in
+    struct stage {
+        int buffer = -1;
+        size_t first = 0;
+        size_t pos = 0;
+    };
+    int ring = -1;
+    int file_handle = -1;
+    // O_DIRECT handle for the aligned middle of each write, -1 to write everything buffered
+    int direct_handle = -1;
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_mask = nullptr, *sq_array = nullptr;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    void* sq_map = MAP_FAILED;
+    void* cq_map = MAP_FAILED;
+    size_t sq_map_size = 0, cq_map_size = 0, sqes_size = 0;
+    std::array<buffer, depth> buffers;
+    unsigned in_flight = 0;
+    uring_writer(int file_handle, int direct_handle)
+        : file_handle(file_handle)
+        , direct_handle(direct_handle)
     {
-        return static_cast<size_t>(offset - base);
+        io_uring_params params = {};
+        ring = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+        if (ring == -1)
+            throw std::runtime_error("io_uring is not available");
+        sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sq_map = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+            IORING_OFF_SQ_RING);
+        cq_map = mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+            IORING_OFF_CQ_RING);
+        auto sqe_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring, IORING_OFF_SQES);
+        if (sq_map == MAP_FAILED || cq_map == MAP_FAILED || sqe_map == MAP_FAILED)
+            throw std::runtime_error("Failed to map the io_uring queues");
+        auto sq = reinterpret_cast<char*>(sq_map);
+        auto cq = reinterpret_cast<char*>(cq_map);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        sqes = reinterpret_cast<io_uring_sqe*>(sqe_map);
+        for (auto& b : buffers) {
+            b.data = static_cast<char*>(std::aligned_alloc(align, chunk_size));
+            if (b.data == nullptr)
+                throw std::bad_alloc();
+        }
     }
-    void seek(size_t n) { offset = base + n; }
-    void skip(size_t n) { offset += n; }
-    template <typename T>
-    T read()
+    uring_writer(uring_writer const&) = delete;
+    ~uring_writer()
     {
-        auto& v = *reinterpret_cast<T const*>(offset);
-        offset += sizeof(T);
-        return v;
+        // The kernel may still be reading from the buffers
+        try {
+            drain();
+        } catch (std::exception const&) {
+        }
+        for (auto& b : buffers)
+            std::free(b.data);
+        if (sqes != nullptr)
+            munmap(sqes, sqes_size);
+        if (cq_map != MAP_FAILED)
+            munmap(cq_map, cq_map_size);
+        if (sq_map != MAP_FAILED)
+            munmap(sq_map, sq_map_size);
+        if (ring != -1)
+            close(ring);
     }
-    int32_t read_cint()
+    static void write_all(int handle, char const* data, size_t length, size_t offset)
     {
-        int8_t a = read<int8_t>();
-        return a != -128 ? a : read<int32_t>();
+        while (length > 0) {
+            auto n = pwrite(handle, data, length, static_cast<off_t>(offset));
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw std::runtime_error("Failed to write the output");
+            data += n;
+            length -= static_cast<size_t>(n);
+            offset += static_cast<size_t>(n);
+        }
+    }
+    void submit(int index, int handle, size_t first, size_t length)
+    {
+        auto& b = buffers[index];
+        b.handle = handle;
+        b.first = first;
+        b.length = length;
+        auto tail = *sq_tail;
+        auto i = tail & *sq_mask;
+        auto& sqe = sqes[i];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITE;
+        sqe.fd = handle;
+        sqe.addr = reinterpret_cast<uint64_t>(b.data + (first - b.offset));
+        sqe.len = static_cast<uint32_t>(length);
+        sqe.off = first;
+        sqe.user_data = static_cast<uint64_t>(index);
+        sq_array[i] = i;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        while (syscall(__NR_io_uring_enter, ring, 1, 0, 0, nullptr, 0) == -1)
+            if (errno != EINTR)
+                throw std::runtime_error("Failed to submit a write");
+        ++in_flight;
+    }
+    // Waits for one write to finish, if any are in flight
+    void reap()
+    {
+        if (in_flight == 0)
+            return;
+        auto head = *cq_head;
+        while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            if (syscall(__NR_io_uring_enter, ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) == -1
+                && errno != EINTR)
+                throw std::runtime_error("Failed to wait for a write");
+        auto cqe = cqes[head & *cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        --in_flight;
+        auto& b = buffers[cqe.user_data];
+        b.busy = false;
+        if (cqe.res < 0)
+            throw std::runtime_error("Failed to write the output: "s + std::strerror(-cqe.res));
+        auto done = static_cast<size_t>(cqe.res);
+        if (done < b.length)
+            write_all(file_handle, b.data + (b.first + done - b.offset), b.length - done,
+                b.first + done);
+    }
+    void drain()
+    {
+        while (in_flight > 0)
+            reap();
+    }
+    int acquire()
+    {
+        for (;;) {
+            for (auto i = 0u; i < depth; ++i) {
+                if (!buffers[i].busy) {
+                    buffers[i].busy = true;
+                    return static_cast<int>(i);
+                }
+            }
+            reap();
+        }
+    }
+    // Writes out [first, end) of a buffer. With O_DIRECT only whole aligned blocks can go
+    // directly, so the ends of a run go through the page cache.
+    void write_out(int index, size_t first, size_t end)
+    {
+        auto& b = buffers[index];
+        auto lo = first, hi = end;
+        if (direct_handle != -1) {
+            lo = (first + align - 1) & ~(align - 1);
+            hi = end & ~(align - 1);
+            if (lo >= hi) {
+                lo = hi = end;
+            }
+            write_all(file_handle, b.data + (first - b.offset), lo - first, first);
+            write_all(file_handle, b.data + (hi - b.offset), end - hi, hi);
+        }
+        if (lo < hi)
+            submit(index, direct_handle != -1 ? direct_handle : file_handle, lo, hi - lo);
+        else
+            b.busy = false;
     }
+    void flush(stage& s)
+    {
+        if (s.buffer == -1)
+            return;
+        write_out(s.buffer, s.first, s.pos);
+        s.buffer = -1;
+    }
+    // Where the next bytes of s go, and how many fit there
+    char* reserve(stage& s, size_t& room)
+    {
+        if (s.buffer != -1 && s.pos == buffers[s.buffer].offset + chunk_size)
+            flush(s);
+        if (s.buffer == -1) {
+            s.buffer = acquire();
+            buffers[s.buffer].offset = s.pos & ~(align - 1);
+            s.first = s.pos;
+        }
+        auto& b = buffers[s.buffer];
+        room = b.offset + chunk_size - s.pos;
+        return b.data + (s.pos - b.offset);
+    }
+    void write(stage& s, void const* data, size_t length)
+    {
+        auto p = static_cast<char const*>(data);
+        while (length > 0) {
+            size_t room;
+            auto d = reserve(s, room);
+            auto n = std::min(room, length);
+            std::memcpy(d, p, n);
+            s.pos += n;
+            p += n;
+            length -= n;
+        }
+    }
+    void seek(stage& s, size_t n)
+    {
+        // Short hops forward, like padding, stay in the same buffer
+        if (s.buffer != -1 && n >= s.pos && n < buffers[s.buffer].offset + chunk_size) {
+            std::memset(buffers[s.buffer].data + (s.pos - buffers[s.buffer].offset), 0, n - s.pos);
+            s.pos = n;
+            return;
+        }
+        flush(s);
+        s.pos = n;
+    }
+};
+#else
+struct uring_writer {
+    struct stage {
+        size_t pos = 0;
+    };
+    uring_writer(int, int) { throw std::runtime_error("io_uring output needs Linux"); }
+    char* reserve(stage&, size_t&) { return nullptr; }
+    void write(stage&, void const*, size_t) { }
+    void seek(stage&, size_t) { }
+    void flush(stage&) { }
+    void drain() { }
 };
-// Output memory mapped file
+#endif
+// Output memory mapped file. It is written under a temporary name next to the final one and only
+// renamed into place by commit, so a crash never leaves a partial file under the final name and
+// readers mapping an existing file never see it change under them.
 struct omapfile {
+    // How the data gets to the file, see uring_writer
+    enum class backend {
+        mmap,
+        uring,
+        direct
+    };
+    backend kind = backend::mmap;
     char* base = nullptr;
     char* offset = nullptr;
+    // End of the mapping, or of the buffer being filled when streaming
+    char* limit = nullptr;
+    std::string path, temp_path;
+    // Bitmaps are appended past the end of what was sized up front
+    std::ofstream appender;
+    std::unique_ptr<uring_writer> writer;
+    uring_writer::stage main, tail;
 #ifdef _WIN32
     void* file_handle = nullptr;
     void* map_handle = nullptr;
     void open(std::string p, size_t size)
     {
+        path = p;
+        temp_path = p + ".tmp";
         file_handle
-            = ::CreateFileA(p.c_str(), GENERIC_READ | GENERIC_WRITE,
+            = ::CreateFileA(temp_path.c_str(), GENERIC_READ | GENERIC_WRITE,
                 FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, CREATE_ALWAYS, 0, nullptr);
         if (file_handle == INVALID_HANDLE_VALUE)
-            throw std::runtime_error("Failed to open file " + p);
+            throw std::runtime_error("Failed to open file " + temp_path);
         map_handle = ::CreateFileMappingA(file_handle, nullptr, PAGE_READWRITE, size >> 32,
             size & 0xffffffff, nullptr);
         if (map_handle == nullptr)
-            throw std::runtime_error("Failed to create file mapping of file " + p);
+            throw std::runtime_error("Failed to create file mapping of file " + temp_path);
         base = reinterpret_cast<char*>(::MapViewOfFile(map_handle, FILE_MAP_ALL_ACCESS, 0, 0, 0));
         if (base == nullptr)
-            throw std::runtime_error("Failed to map view of file " + p);
+            throw std::runtime_error("Failed to map view of file " + temp_path);
         offset = base;
+        limit = base + size;
+        tail.pos = size;
+        if (kind != backend::mmap)
+            writer = std::make_unique<uring_writer>(0, -1);
+    }
+    void commit()
+    {
+        appender.close();
+        ::UnmapViewOfFile(base);
+        ::CloseHandle(map_handle);
+        base = nullptr;
+        map_handle = nullptr;
+        ::FlushFileBuffers(file_handle);
+        ::CloseHandle(file_handle);
+        file_handle = nullptr;
+        if (!::MoveFileExA(temp_path.c_str(), path.c_str(),
+                MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+            throw std::runtime_error("Failed to move " + temp_path + " to " + path);
     }
     ~omapfile()
     {
+        if (file_handle == nullptr)
+            return;
         ::UnmapViewOfFile(base);
         ::CloseHandle(map_handle);
         ::CloseHandle(file_handle);
+        ::DeleteFileA(temp_path.c_str());
     }
 #else
-    int file_handle = 0;
+    int file_handle = -1;
+    int direct_handle = -1;
     size_t file_size = 0;
     void open(std::string p, uint64_t size)
     {
-        file_handle
-            = ::open(p.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        path = p;
+        temp_path = p + ".XXXXXX";
+        file_handle = ::mkstemp(&temp_path[0]);
         if (file_handle == -1)
-            throw std::runtime_error("Failed to open file " + p);
+            throw std::runtime_error("Failed to create a temporary file for " + p);
+        // mkstemp makes the file private, give it the permissions a new file would get
+        ::fchmod(file_handle, new_file_mode());
         file_size = size;
-        if (::lseek(file_handle, file_size - 1, SEEK_SET) == -1)
-            throw std::runtime_error("Error calling lseek() to 'stretch' file " + p);
-        if (::write(file_handle, "", 1) != 1)
-            throw std::runtime_error("Error writing last byte of file " + p);
+        // Real extents instead of a sparse file, which fragments as it gets filled in
+        if (::posix_fallocate(file_handle, 0, static_cast<off_t>(file_size)) != 0
+            && ::ftruncate(file_handle, static_cast<off_t>(file_size)) == -1)
+            throw std::runtime_error("Failed to allocate file " + temp_path);
+        tail.pos = file_size;
+        if (kind != backend::mmap) {
+#ifdef O_DIRECT
+            if (kind == backend::direct) {
+                direct_handle = ::open(temp_path.c_str(), O_WRONLY | O_DIRECT);
+                if (direct_handle == -1)
+                    std::cerr << "O_DIRECT is not supported for " << temp_path
+                              << ", writing through the page cache" << std::endl;
+            }
+#endif
+            writer = std::make_unique<uring_writer>(file_handle, direct_handle);
+            main.pos = 0;
+            refresh();
+            return;
+        }
         base = reinterpret_cast<char*>(
             ::mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, file_handle, 0));
         if (reinterpret_cast<intptr_t>(base) == -1)
-            throw std::runtime_error("Failed to create memory mapping of file " + p);
+            throw std::runtime_error("Failed to create memory mapping of file " + temp_path);
         offset = base;
+        limit = base + file_size;
+    }
+    // Makes the finished file durable and moves it to its final name
+    void commit()
+    {
+        appender.close();
+        if (writer) {
+            main.pos = tell();
+            writer->flush(main);
+            writer->flush(tail);
+            writer->drain();
+            writer.reset();
+            if (direct_handle != -1)
+                ::close(direct_handle);
+            direct_handle = -1;
+        } else {
+            ::munmap(base, file_size);
+        }
+        base = nullptr;
+        if (::fsync(file_handle) == -1)
+            throw std::runtime_error("Failed to sync file " + temp_path);
+        ::close(file_handle);
+        file_handle = -1;
+        if (::rename(temp_path.c_str(), path.c_str()) == -1)
+            throw std::runtime_error("Failed to move " + temp_path + " to " + path);
+        auto dir = sys::path { path }.parent_path();
+        auto dir_handle = ::open(dir.empty() ? "." : u8string(dir).c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir_handle != -1) {
+            ::fsync(dir_handle);
+            ::close(dir_handle);
+        }
     }
-    void close()
+    ~omapfile()
     {
-        ::munmap(const_cast<char*>(base), file_size);
+        if (file_handle == -1)
+            return;
+        if (writer)
+            writer.reset();
+        else
+            ::munmap(base, file_size);
+        if (direct_handle != -1)
+            ::close(direct_handle);
         ::close(file_handle);
+        ::unlink(temp_path.c_str());
     }
 #endif
     size_t tell()
     {
         return static_cast<size_t>(offset - base);
     }
-    void seek(size_t n) { offset = base + n; }
-    void skip(size_t n) { offset += n; }
+    // Points the cursor at the buffer the writer fills next
+    void refresh()
+    {
+        size_t room;
+        auto d = writer->reserve(main, room);
+        base = d - main.pos;
+        offset = d;
+        limit = d + room;
+    }
+    void seek(size_t n)
+    {
+        if (!writer) {
+            offset = base + n;
+            return;
+        }
+        main.pos = tell();
+        writer->seek(main, n);
+        refresh();
+    }
+    void skip(size_t n)
+    {
+        if (!writer)
+            offset += n;
+        else
+            seek(tell() + n);
+    }
     template <typename T>
     void write(T const& v)
     {
-        *reinterpret_cast<T*>(offset) = v;
-        offset += sizeof(T);
+        write(&v, sizeof(T));
     }
     void write(void const* buf, size_t size)
     {
-        std::memcpy(offset, buf, size);
-        offset += size;
+        if (static_cast<size_t>(limit - offset) >= size) {
+            std::memcpy(offset, buf, size);
+            offset += size;
+            return;
+        }
+        if (!writer)
+            throw std::runtime_error("Write past the end of " + temp_path);
+        main.pos = tell();
+        writer->write(main, buf, size);
+        refresh();
+    }
+    // Gives the next size bytes to be appended real extents in one piece, like open does for
+    // what was sized up front. A hint only, append works without it.
+    void preallocate(size_t size)
+    {
+#ifndef _WIN32
+        ::posix_fallocate(file_handle, static_cast<off_t>(tail.pos), static_cast<off_t>(size));
+#else
+        static_cast<void>(size);
+#endif
+    }
+    // Adds to the end of the file, after everything that was sized up front
+    void append(void const* buf, size_t size)
+    {
+        if (writer) {
+            writer->write(tail, buf, size);
+            return;
+        }
+        // Written at tail.pos rather than the end of the file, which preallocate moves
+        if (!appender.is_open()) {
+            appender.open(temp_path, std::ios::in | std::ios::out | std::ios::binary);
+            appender.seekp(static_cast<std::streamoff>(tail.pos));
+        }
+        appender.write(static_cast<char const*>(buf), static_cast<std::streamsize>(size));
+        tail.pos += size;
     }
 };
 // Node stuff
@@ -326,24 +1240,473 @@ struct node {
     } data;
 };
 #pragma pack(pop)
-struct audio {
-    uint32_t length;
-    uint64_t data;
-};
-struct bitmap {
-    uint64_t data;
-    uint8_t const* key;
+// Optional sections past the ones every reader knows about. The padding after the 52 byte
+// header holds the magic and the offset of a directory of them, which stock readers never look
+// at. The directory is a u32 count, 4 bytes of padding and then one of these per section.
+struct nx_extension {
+    static constexpr uint32_t magic = 0x3158584e; // NXX1
+    enum kind : uint32_t {
+        child_index = 0x58494843, // CHIX
+        string_hashes = 0x48525453, // STRH
+        bitmap_codecs = 0x444f4342 // BCOD
+    };
+    uint32_t tag;
+    uint32_t version;
+    uint64_t offset;
+    uint64_t size;
+    // FNV-1a, which the sections key names by
+    static uint64_t name_hash(char const* s, size_t length)
+    {
+        auto hash = uint64_t { 14695981039346656037u };
+        for (auto i = size_t { 0 }; i < length; ++i) {
+            hash ^= static_cast<uint8_t>(s[i]);
+            hash *= 1099511628211u;
+        }
+        return hash;
+    }
 };
-// The main class itself
-struct wztonx {
-    // Variables
-    imapfile in;
-    omapfile out;
-    std::vector<node> nodes = std::vector<node> { { node {} } };
-    std::vector<std::pair<id_t, id_t>> nodes_to_sort;
-    std::unordered_map<uint32_t, id_t, identity<uint32_t>> string_map;
-    std::vector<std::string> strings;
-    std::string str_buf;
+// Node records of compact server NX files, which have no bitmaps or sounds for nodes to point
+// at. A record is a byte with the type and flags for what follows, then LEB128 varints: the
+// name, the child count and signed distance to the first child when there are children, and
+// the data. Integers and vectors are zigzag encoded, bitmaps keep their size and sounds their
+// length. Records are found through an index of where every block'th one starts.
+struct compact_record {
+    static constexpr uint32_t magic = 0x3143584e; // NXC1
+    static constexpr uint32_t version = 1;
+    static constexpr uint32_t block = 8;
+    static constexpr uint8_t has_children = 0x08, single = 0x10, leftover = 0x20;
+    static void put(std::string& s, uint64_t v)
+    {
+        for (; v >= 0x80; v >>= 7)
+            s += static_cast<char>(v | 0x80);
+        s += static_cast<char>(v);
+    }
+    static uint64_t zigzag(int64_t v)
+    {
+        return static_cast<uint64_t>(v) << 1 ^ static_cast<uint64_t>(v >> 63);
+    }
+    static int64_t unzigzag(uint64_t v)
+    {
+        return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+    }
+    static void encode(std::string& s, node const& n, uint32_t id)
+    {
+        auto head = static_cast<uint8_t>(n.data_type);
+        auto real = static_cast<float>(n.data.real);
+        // Childless nodes can still have a meaningless first child, which is kept as it is
+        if (n.num != 0 || n.children != 0)
+            head |= has_children;
+        if (n.data_type == node::type::real && static_cast<double>(real) == n.data.real)
+            head |= single;
+        // UOLs that failed to resolve keep their string in an empty node
+        if (n.data_type == node::type::none && n.data.integer != 0)
+            head |= leftover;
+        s += static_cast<char>(head);
+        put(s, n.name);
+        if (head & has_children) {
+            put(s, n.num);
+            put(s, zigzag(int64_t { n.children } - id));
+        }
+        switch (n.data_type) {
+        case node::type::none:
+            if (head & leftover)
+                put(s, zigzag(n.data.integer));
+            break;
+        case node::type::integer:
+            put(s, zigzag(n.data.integer));
+            break;
+        case node::type::real:
+            if (head & single)
+                s.append(reinterpret_cast<char const*>(&real), 4);
+            else
+                s.append(reinterpret_cast<char const*>(&n.data.real), 8);
+            break;
+        case node::type::string:
+        case node::type::uol:
+            put(s, n.data.string);
+            break;
+        case node::type::vector:
+            put(s, zigzag(n.data.vector[0]));
+            put(s, zigzag(n.data.vector[1]));
+            break;
+        case node::type::bitmap:
+            put(s, n.data.bitmap.width);
+            put(s, n.data.bitmap.height);
+            break;
+        case node::type::audio:
+            put(s, n.data.audio.length);
+            break;
+        default:
+            break;
+        }
+    }
+    // Decodes the record of node id at p into n, returning where the next one starts
+    static char const* decode(char const* p, char const* end, node& n, uint32_t id)
+    {
+        auto fail = [] { throw std::runtime_error("Broken compact node record"); };
+        auto get = [&] {
+            auto v = uint64_t { 0 };
+            for (auto shift = 0; shift < 64; shift += 7) {
+                if (p == end)
+                    break;
+                auto b = static_cast<uint8_t>(*p++);
+                v |= uint64_t { b & 0x7fu } << shift;
+                if (!(b & 0x80))
+                    return v;
+            }
+            fail();
+            return v;
+        };
+        if (p == end)
+            fail();
+        auto head = static_cast<uint8_t>(*p++);
+        n = {};
+        n.data_type = static_cast<node::type>(head & 7);
+        n.name = static_cast<uint32_t>(get());
+        if (head & has_children) {
+            n.num = static_cast<uint16_t>(get());
+            n.children = static_cast<uint32_t>(id + unzigzag(get()));
+        }
+        switch (n.data_type) {
+        case node::type::none:
+            if (head & leftover)
+                n.data.integer = unzigzag(get());
+            break;
+        case node::type::integer:
+            n.data.integer = unzigzag(get());
+            break;
+        case node::type::real:
+            if (end - p < (head & single ? 4 : 8))
+                fail();
+            if (head & single) {
+                float real;
+                std::memcpy(&real, p, 4);
+                n.data.real = real;
+                p += 4;
+            } else {
+                std::memcpy(&n.data.real, p, 8);
+                p += 8;
+            }
+            break;
+        case node::type::string:
+        case node::type::uol:
+            n.data.string = static_cast<uint32_t>(get());
+            break;
+        case node::type::vector:
+            n.data.vector[0] = static_cast<int32_t>(unzigzag(get()));
+            n.data.vector[1] = static_cast<int32_t>(unzigzag(get()));
+            break;
+        case node::type::bitmap:
+            n.data.bitmap.width = static_cast<uint16_t>(get());
+            n.data.bitmap.height = static_cast<uint16_t>(get());
+            break;
+        case node::type::audio:
+            n.data.audio.length = static_cast<uint32_t>(get());
+            break;
+        default:
+            break;
+        }
+        return p;
+    }
+};
+// Node table made of fixed size chunks. Growing it never moves or copies existing nodes, so
+// references stay valid while children are appended.
+struct node_arena {
+    static constexpr size_t chunk_bits = 16;
+    static constexpr size_t chunk_size = size_t { 1 } << chunk_bits;
+    struct chunk_deleter {
+        void operator()(node* p) const { ::operator delete(p); }
+    };
+    std::vector<std::unique_ptr<node, chunk_deleter>> chunks;
+    size_t count = 0;
+    struct iterator {
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef node value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef node* pointer;
+        typedef node& reference;
+        node_arena* arena;
+        size_t index;
+        reference operator*() const { return (*arena)[index]; }
+        pointer operator->() const { return &(*arena)[index]; }
+        reference operator[](difference_type n) const { return (*arena)[index + n]; }
+        iterator& operator++() { return ++index, *this; }
+        iterator& operator--() { return --index, *this; }
+        iterator operator++(int) { return { arena, index++ }; }
+        iterator operator--(int) { return { arena, index-- }; }
+        iterator& operator+=(difference_type n) { return index += n, *this; }
+        iterator& operator-=(difference_type n) { return index -= n, *this; }
+        iterator operator+(difference_type n) const { return { arena, index + n }; }
+        iterator operator-(difference_type n) const { return { arena, index - n }; }
+        friend iterator operator+(difference_type n, iterator const& it) { return it + n; }
+        difference_type operator-(iterator const& o) const
+        {
+            return static_cast<difference_type>(index) - static_cast<difference_type>(o.index);
+        }
+        bool operator==(iterator const& o) const { return index == o.index; }
+        bool operator!=(iterator const& o) const { return index != o.index; }
+        bool operator<(iterator const& o) const { return index < o.index; }
+        bool operator>(iterator const& o) const { return index > o.index; }
+        bool operator<=(iterator const& o) const { return index <= o.index; }
+        bool operator>=(iterator const& o) const { return index >= o.index; }
+    };
+    explicit node_arena(size_t n = 0) { resize(n); }
+    node& operator[](size_t i) { return chunks[i >> chunk_bits].get()[i & (chunk_size - 1)]; }
+    size_t size() const { return count; }
+    iterator begin() { return { this, 0 }; }
+    iterator end() { return { this, count }; }
+    // Chunks are only address space until nodes are placed in them
+    void reserve(size_t n)
+    {
+        while (chunks.size() << chunk_bits < n)
+            chunks.emplace_back(static_cast<node*>(::operator new(chunk_size * sizeof(node))));
+    }
+    void resize(size_t n)
+    {
+        reserve(n);
+        for (; count < n; ++count)
+            new (&(*this)[count]) node {};
+        count = n;
+    }
+    void clear() { count = 0; }
+    void emplace_back() { resize(count + 1); }
+    void append(iterator first, iterator last)
+    {
+        reserve(count + static_cast<size_t>(last - first));
+        for (; first != last; ++first, ++count)
+            new (&(*this)[count]) node(*first);
+    }
+    // Calls f(data, size) for each contiguous run of nodes, in order
+    template <typename F>
+    void for_each_chunk(F f)
+    {
+        for (auto i = size_t { 0 }; i < count; i += chunk_size)
+            f(chunks[i >> chunk_bits].get(), std::min(chunk_size, count - i));
+    }
+};
+struct audio {
+    uint32_t length;
+    uint64_t data;
+};
+struct bitmap {
+    uint64_t data;
+    uint8_t const* key;
+};
+// How bitmap blobs are compressed. Every reader expects LZ4, which decodes the fastest, the
+// others make smaller archival copies. Files using them have a bitmap_codecs section: a u32
+// bitmap count, a u32 dictionary size, the kind of every bitmap as a byte, padding to 8 bytes
+// and the dictionary zstd was trained with. Their header starts with PKGC in place of PKG4, so
+// readers that would take every blob for LZ4 turn them down. zstd needs NL_ZSTD and libzstd.
+struct bitmap_codec {
+    static constexpr uint32_t magic = 0x43474B50; // PKGC
+    enum kind : uint8_t {
+        lz4 = 0,
+        deflate = 1,
+        zstd = 2
+    };
+    static constexpr kind kinds[] = { lz4, deflate, zstd };
+    // Canvases sampled for a dictionary, and how much of each
+    static constexpr size_t dictionary_samples = 1000;
+    static constexpr size_t sample_size = 0x8000;
+    static constexpr size_t dictionary_size = 112 << 10;
+    kind type = lz4;
+    // The slow levels, LZ4HC for LZ4
+    bool high = false;
+    std::vector<uint8_t> dictionary;
+#ifdef NL_ZSTD
+    std::shared_ptr<ZSTD_CDict> cdict;
+    std::shared_ptr<ZSTD_DDict> ddict;
+#endif
+    static char const* name(kind k)
+    {
+        switch (k) {
+        case deflate:
+            return "deflate";
+        case zstd:
+            return "zstd";
+        default:
+            return "lz4";
+        }
+    }
+    static bool available(kind k)
+    {
+#ifndef NL_ZSTD
+        if (k == zstd)
+            return false;
+#endif
+        return k <= zstd;
+    }
+    int level() const
+    {
+        if (type == deflate)
+            return high ? 9 : 6;
+        return high ? 19 : 9;
+    }
+    size_t bound(size_t n) const
+    {
+        switch (type) {
+        case deflate:
+            return compressBound(static_cast<uLong>(n));
+#ifdef NL_ZSTD
+        case zstd:
+            return ZSTD_compressBound(n);
+#endif
+        default:
+            return static_cast<size_t>(LZ4_compressBound(static_cast<int>(n)));
+        }
+    }
+    // The size of the blob, 0 when it did not fit into capacity
+    uint32_t compress(uint8_t const* src, size_t n, uint8_t* dst, size_t capacity) const
+    {
+        switch (type) {
+        case deflate: {
+            auto length = static_cast<uLongf>(capacity);
+            if (compress2(dst, &length, src, static_cast<uLong>(n), level()) != Z_OK)
+                return 0;
+            return static_cast<uint32_t>(length);
+        }
+#ifdef NL_ZSTD
+        case zstd: {
+            thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> ctx { ZSTD_createCCtx(), ZSTD_freeCCtx };
+            auto r = cdict ? ZSTD_compress_usingCDict(ctx.get(), dst, capacity, src, n, cdict.get())
+                           : ZSTD_compressCCtx(ctx.get(), dst, capacity, src, n, level());
+            return ZSTD_isError(r) ? 0 : static_cast<uint32_t>(r);
+        }
+#endif
+        default:
+            if (high)
+                return static_cast<uint32_t>(LZ4_compressHC(reinterpret_cast<char const*>(src),
+                    reinterpret_cast<char*>(dst), static_cast<int>(n)));
+            return static_cast<uint32_t>(LZ4_compress(reinterpret_cast<char const*>(src),
+                reinterpret_cast<char*>(dst), static_cast<int>(n)));
+        }
+    }
+    // Whether the blob decodes to exactly size bytes
+    bool decompress(uint8_t const* src, size_t n, uint8_t* dst, size_t size) const
+    {
+        switch (type) {
+        case deflate: {
+            auto length = static_cast<uLongf>(size);
+            return uncompress(dst, &length, src, static_cast<uLong>(n)) == Z_OK && length == size;
+        }
+#ifdef NL_ZSTD
+        case zstd: {
+            thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> ctx { ZSTD_createDCtx(), ZSTD_freeDCtx };
+            auto r = ddict ? ZSTD_decompress_usingDDict(ctx.get(), dst, size, src, n, ddict.get())
+                           : ZSTD_decompressDCtx(ctx.get(), dst, size, src, n);
+            return !ZSTD_isError(r) && r == size;
+        }
+#endif
+        default:
+            return LZ4_decompress_safe(reinterpret_cast<char const*>(src), reinterpret_cast<char*>(dst),
+                       static_cast<int>(n), static_cast<int>(size))
+                == static_cast<int>(size);
+        }
+    }
+    // Builds a dictionary out of samples laid end to end, for zstd only. With too little to go
+    // on there is none and zstd compresses every canvas on its own.
+    void train(std::vector<uint8_t> const& samples, std::vector<size_t> const& sizes)
+    {
+        dictionary.clear();
+#ifdef NL_ZSTD
+        cdict.reset();
+        ddict.reset();
+        if (type != zstd || sizes.empty())
+            return;
+        dictionary.resize(dictionary_size);
+        auto r = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(), samples.data(), sizes.data(),
+            static_cast<unsigned>(sizes.size()));
+        if (ZDICT_isError(r)) {
+            dictionary.clear();
+            return;
+        }
+        dictionary.resize(r);
+        cdict.reset(ZSTD_createCDict(dictionary.data(), dictionary.size(), level()), ZSTD_freeCDict);
+        ddict.reset(ZSTD_createDDict(dictionary.data(), dictionary.size()), ZSTD_freeDDict);
+#else
+        static_cast<void>(samples);
+        static_cast<void>(sizes);
+#endif
+    }
+};
+// Which parts of the tree to convert, from --include and --exclude patterns. A pattern is a
+// path from the root like Map/Map*/*.img/info, where * and ? only match within one name. A
+// node goes when an exclude pattern matches it or a parent. Given include patterns, a node
+// also has to be matched by one, below one, or on the way to what one could match.
+struct path_filter {
+    enum class verdict {
+        drop,
+        keep, // Along with everything below
+        some // But the children have to be checked
+    };
+    std::vector<std::vector<std::string>> include, exclude;
+    // Names in the longest pattern, past which nothing changes anymore
+    size_t depth = 0;
+    bool empty() const { return include.empty() && exclude.empty(); }
+    // False for a pattern without a single name in it
+    bool add(std::vector<std::vector<std::string>>& to, std::string const& pattern)
+    {
+        std::istringstream stream(pattern);
+        std::vector<std::string> parts;
+        std::string part;
+        while (std::getline(stream, part, '/'))
+            if (!part.empty())
+                parts.push_back(part);
+        if (parts.empty())
+            return false;
+        depth = std::max(depth, parts.size());
+        to.push_back(std::move(parts));
+        return true;
+    }
+    static bool glob(std::string const& p, std::string const& s)
+    {
+        auto pi = size_t { 0 }, si = size_t { 0 }, star = std::string::npos, mark = size_t { 0 };
+        while (si < s.size()) {
+            if (pi < p.size() && (p[pi] == '?' || p[pi] == s[si])) {
+                ++pi;
+                ++si;
+            } else if (pi < p.size() && p[pi] == '*') {
+                star = pi++;
+                mark = si;
+            } else if (star != std::string::npos) {
+                pi = star + 1;
+                si = ++mark;
+            } else {
+                return false;
+            }
+        }
+        while (pi < p.size() && p[pi] == '*')
+            ++pi;
+        return pi == p.size();
+    }
+    verdict check(std::vector<std::string> const& path) const
+    {
+        auto matches = [&](std::vector<std::string> const& pattern) {
+            auto n = std::min(pattern.size(), path.size());
+            for (auto i = size_t { 0 }; i < n; ++i)
+                if (!glob(pattern[i], path[i]))
+                    return false;
+            return true;
+        };
+        for (auto& e : exclude)
+            if (e.size() <= path.size() && matches(e))
+                return verdict::drop;
+        if (!include.empty() && std::none_of(include.begin(), include.end(), matches))
+            return verdict::drop;
+        return path.size() >= depth ? verdict::keep : verdict::some;
+    }
+};
+// Everything needed to turn WZ data into nodes and strings
+struct parser {
+    // Variables
+    icursor in;
+    node_arena nodes = node_arena(1);
+    std::vector<std::pair<id_t, id_t>> nodes_to_sort;
+    std::unordered_map<uint64_t, id_t, identity<uint64_t>> string_map;
+    std::vector<std::string> strings;
+    // The hash of each string, see nx_extension::name_hash
+    std::vector<uint64_t> string_hashes;
+    std::string str_buf;
     std::u16string wstr_buf;
 #ifndef NL_NO_CODECVT
     std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>, wchar_t> convert;
@@ -351,17 +1714,16 @@ struct wztonx {
     char8_t const* u8key = nullptr;
     char16_t const* u16key = nullptr;
     std::vector<std::pair<id_t, int32_t>> imgs;
+    // Imgs the filter drops go into imgs as node 0, and are never parsed
+    path_filter filter;
+    // Without it canvases and sounds are only marked, for server output that has no use for
+    // them. prune_nodes turns them into empty nodes.
+    bool media = true;
+    // The imgs from index first on start at offset second, when they are not all back to back
+    std::vector<std::pair<size_t, size_t>> img_runs;
     size_t file_start = 0;
-    std::vector<id_t> uol_path;
-    std::vector<std::vector<id_t>> uols;
-    std::vector<id_t> link_path;
-    std::vector<std::vector<id_t>> links;
     std::vector<bitmap> bitmaps;
     std::vector<audio> audios;
-    size_t offset, node_offset, string_offset, string_table_offset, bitmap_offset,
-        bitmap_table_offset, audio_offset, audio_table_offset;
-    bool client, hc;
-    std::string wzfilename, nxfilename;
     // Methods
     std::string convert_str(std::u16string const& p_str)
     {
@@ -377,16 +1739,17 @@ struct wztonx {
     }
     id_t add_string(std::string str)
     {
-        uint32_t hash = 2166136261u;
-        for (auto c : str) {
-            hash ^= c;
-            hash *= 16777619u;
-        }
+        auto hash = nx_extension::name_hash(str.data(), str.size());
+        return add_string(std::move(str), hash);
+    }
+    id_t add_string(std::string str, uint64_t hash)
+    {
         auto& id = string_map[hash];
         if (id != 0)
             return id;
         id = static_cast<id_t>(strings.size());
         strings.push_back(std::move(str));
+        string_hashes.push_back(hash);
         return id;
     }
     id_t read_enc_string()
@@ -394,24 +1757,27 @@ struct wztonx {
         auto len = in.read<int8_t>();
         if (len > 0) {
             auto slen = len == 127 ? in.read<uint32_t>() : len;
-            auto ows = reinterpret_cast<char16_t const*>(in.offset);
-            in.skip(slen * 2u);
+            auto ows = in.view(size_t { slen } * 2);
             auto mask = 0xAAAAu;
             wstr_buf.resize(slen);
+            auto wchar = [&](uint32_t i) {
+                char16_t c;
+                std::memcpy(&c, ows + i * 2, 2);
+                return c;
+            };
             for (auto i = 0u; i < std::min(slen, 0x10000u); ++i) {
-                wstr_buf[i] = static_cast<char16_t>(ows[i] ^ u16key[i] ^ mask);
+                wstr_buf[i] = static_cast<char16_t>(wchar(i) ^ u16key[i] ^ mask);
                 ++mask;
             }
             for (auto i = 0x10000u; i < slen; ++i) {
-                wstr_buf[i] = static_cast<char16_t>(ows[i] ^ mask);
+                wstr_buf[i] = static_cast<char16_t>(wchar(i) ^ mask);
                 ++mask;
             }
             return add_string(convert_str(wstr_buf));
         }
         if (len < 0) {
             auto slen = len == -128 ? in.read<uint32_t>() : -len;
-            auto os = reinterpret_cast<char8_t const*>(in.offset);
-            in.skip(slen);
+            auto os = reinterpret_cast<char8_t const*>(in.view(slen));
             auto mask = 0xAAu;
             str_buf.resize(slen);
             for (auto i = 0u; i < std::min(slen, 0x10000u); ++i) {
@@ -449,318 +1815,345 @@ struct wztonx {
             return s;
         }
         default:
-            throw std::runtime_error("Unknown property string type: " + std::to_string(a));
+            throw wz_error("Unknown property string type " + std::to_string(a), in.tell() - 1);
         }
     }
-    void deduce_key()
+    // Cursor position and length of encrypted 8-bit strings used to tell the keys apart
+    std::vector<std::pair<size_t, uint32_t>> key_samples;
+    // Records the encrypted string at the cursor as a sample and skips over it
+    bool sample_string()
     {
+        if (in.remaining() < 5)
+            return false;
         auto len = in.read<int8_t>();
         if (len >= 0)
-            throw std::runtime_error("I give up");
+            return false;
         auto slen = len == -128 ? in.read<uint32_t>() : -len;
-        u8key = nullptr;
-        for (auto key : keys) {
-            auto os = reinterpret_cast<char8_t const*>(in.offset);
-            uint8_t mask = 0xAA;
-            auto k = reinterpret_cast<char8_t const*>(key);
-            bool valid = true;
-            for (auto i = 0u; i < slen; ++i, ++mask) {
-                auto c = static_cast<uint8_t>(os[i] ^ k[i] ^ mask);
-                if (c < 0x20 || c >= 0x80) {
-                    valid = false;
+        if (slen > in.remaining())
+            return false;
+        key_samples.emplace_back(in.tell(), std::min(slen, 0x10000u));
+        in.skip(slen);
+        return true;
+    }
+    // Names of the directory entries following the first one
+    void sample_directory(int32_t entries)
+    {
+        in.read_cint();
+        in.read_cint();
+        in.skip(4);
+        for (auto i = 1; i < std::min(entries, 5) && in.remaining() >= 8; ++i) {
+            auto type = in.read<uint8_t>();
+            if (type == 2) {
+                auto o = file_start + in.read<int32_t>() + 1;
+                auto p = in.tell();
+                if (o < in.size()) {
+                    in.seek(o);
+                    sample_string();
+                    in.seek(p);
                 }
+            } else if (type == 3 || type == 4) {
+                sample_string();
+            } else {
+                return;
             }
-            if (valid) {
-                u8key = reinterpret_cast<char8_t const*>(key);
-                u16key = reinterpret_cast<char16_t const*>(key);
-            }
+            in.read_cint();
+            in.read_cint();
+            in.skip(4);
         }
-        if (!u8key)
-            throw std::runtime_error("Failed to identify the locale");
-        in.skip(slen);
     }
-    void sort_nodes(id_t first, id_t count)
+    // Name of the first property of an img starting at p_offset
+    void sample_property(size_t p_offset)
     {
-        std::sort(nodes.begin() + first, nodes.begin() + first + count,
-            [this](node const& n1, node const& n2) {
-                return strings[n1.name] < strings[n2.name];
-            });
+        if (in.remaining() < 8)
+            return;
+        in.skip(2);
+        if (in.read_cint() <= 0)
+            return;
+        auto a = in.read<uint8_t>();
+        if (a == 0x00 || a == 0x73) {
+            sample_string();
+        } else if (a == 0x01 || a == 0x1B) {
+            auto o = in.read<int32_t>() + p_offset;
+            if (o < in.size()) {
+                in.seek(o);
+                sample_string();
+            }
+        }
     }
-    void find_uols(id_t uol_node)
+    bool key_fits(::Key* k, std::pair<size_t, uint32_t> sample)
     {
-        auto& n = nodes[uol_node];
-        if (n.data_type == node::type::uol) {
-            uol_path.push_back(uol_node);
-            uols.push_back(uol_path);
-            uol_path.pop_back();
-        } else if (n.num != 0) {
-            uol_path.push_back(uol_node);
-            for (auto i = 0u; i < n.num; ++i)
-                find_uols(n.children + i);
-            uol_path.pop_back();
+        auto p = in.tell();
+        in.seek(sample.first);
+        auto os = reinterpret_cast<uint8_t const*>(in.view(sample.second));
+        in.seek(p);
+        auto key = k->data(sample.second);
+        uint8_t mask = 0xAA;
+        for (auto i = 0u; i < sample.second; ++i, ++mask) {
+            auto c = static_cast<uint8_t>(os[i] ^ key[i] ^ mask);
+            if (c < 0x20 || c >= 0x80)
+                return false;
         }
+        return true;
     }
-    // std::vector<std::string> name_path;
-    void find_links(id_t link_node, std::string const& str)
+    // Finds the key of the encrypted string at the cursor and skips over it. more_samples adds
+    // strings further on, and is only called when that string alone is not enough.
+    template <typename F>
+    void deduce_key(F more_samples)
     {
-        auto& n = nodes[link_node];
-        auto& s = strings[n.name];
-        if (s == str) {
-            link_path.push_back(link_node);
-            // name_path.push_back(s);
-            links.push_back(link_path);
-            link_path.pop_back();
-            // name_path.pop_back();
-        } else if (n.num != 0) {
-            link_path.push_back(link_node);
-            // name_path.push_back(s);
-            for (auto i = 0u; i < n.num; ++i)
-                find_links(n.children + i, str);
-            link_path.pop_back();
-            // name_path.pop_back();
+        key_samples.clear();
+        if (!sample_string())
+            throw wz_error("No string to identify the key by", in.tell());
+        auto p = in.tell();
+        auto sampled = false;
+        auto sample_more = [&] {
+            if (!sampled)
+                more_samples();
+            sampled = true;
+        };
+        auto score = [this](::Key* key) {
+            return std::count_if(key_samples.begin(), key_samples.end(),
+                [&](std::pair<size_t, uint32_t> s) { return key_fits(key, s); });
+        };
+        // Only the input decides, never which key an earlier img used, so every thread count
+        // picks the same key for the same bytes
+        std::vector<::Key*> candidates;
+        for (auto key : keys)
+            if (key_fits(key, key_samples.front()))
+                candidates.push_back(key);
+        if (candidates.empty())
+            throw wz_error("Failed to identify the locale", in.tell());
+        auto found = candidates[0];
+        if (candidates.size() > 1) {
+            // A short string can fit the wrong key by chance, so check more before choosing
+            sample_more();
+            // Ties go to the later key, like they always have
+            auto best = score(found);
+            for (auto i = 1u; i < candidates.size(); ++i) {
+                auto sc = score(candidates[i]);
+                if (sc >= best) {
+                    found = candidates[i];
+                    best = sc;
+                }
+            }
         }
+        u8key = reinterpret_cast<char8_t const*>(found->data());
+        u16key = reinterpret_cast<char16_t const*>(found->data());
+        in.seek(p);
     }
-    id_t get_child(id_t parent_node, std::string const& str)
+    static constexpr size_t no_offset = ~size_t { 0 };
+    // Pending parse work. A frame refers to nodes only by id and to the input only through
+    // offsets, so it can be resumed by whichever cursor picks it up.
+    struct frame {
+        enum class kind : uint8_t {
+            directory,
+            property,
+            extended,
+            convex,
+            canvas
+        };
+        kind type;
+        uint32_t depth;
+        id_t node;
+        id_t first = 0;
+        id_t count = 0;
+        id_t index = 0;
+        size_t p_offset = 0;
+        size_t end = no_offset;
+    };
+    // Nothing legitimate comes close to this, it only exists to stop hostile input
+    static constexpr uint32_t max_depth = 0x400;
+    std::vector<frame> frames;
+    void push_frame(frame f)
     {
-        if (parent_node == 0)
-            return 0;
-        auto& n = nodes[parent_node];
-        auto first = nodes.begin() + n.children;
-        auto last = first + n.num;
-        auto it = std::lower_bound(first, last, str, [this](node const& n, std::string const& s) {
-            return strings[n.name] < s;
-        });
-        if (it == last)
-            return 0;
-        if (strings[it->name] != str)
-            return 0;
-        return static_cast<id_t>(it - nodes.begin());
+        if (f.depth > max_depth)
+            throw wz_error("Nesting too deep", in.tell());
+        frames.push_back(f);
     }
-    id_t get_child_full(id_t parent_node, std::string const& str)
+    // Reads a child count and allocates that many nodes, each child being at least min_size bytes
+    id_t read_children(id_t parent_node, size_t min_size)
     {
+        auto count = in.read_cint();
+        if (count < 0 || count > 0xffff)
+            throw wz_error("Invalid child count " + std::to_string(count), in.tell());
+        if (static_cast<size_t>(count) * min_size > in.remaining())
+            throw wz_error("Child count " + std::to_string(count) + " runs past the end of the region",
+                in.tell());
+        auto ni = static_cast<id_t>(nodes.size());
         auto& n = nodes[parent_node];
-        auto first = nodes.begin() + n.children;
-        auto last = first + n.num;
-        auto it = std::lower_bound(first, last, str, [this](node const& n, std::string const& s) {
-            return strings[n.name] < s;
-        });
-        if (it == last)
-            return 0;
-        if (strings[it->name] != str)
-            return 0;
-        return static_cast<id_t>(it - nodes.begin());
+        n.num = static_cast<uint16_t>(count);
+        n.children = ni;
+        nodes.resize(ni + static_cast<id_t>(count));
+        nodes_to_sort.emplace_back(ni, static_cast<id_t>(count));
+        return ni;
     }
-    bool resolve_uol(std::vector<id_t> uol)
+    void finish_frame(frame const& f)
     {
-        auto& n = nodes[uol.back()];
-        uol.pop_back();
-        if (n.data_type != node::type::uol)
-            throw std::runtime_error("Welp. I failed.");
-        auto& s = strings[n.data.string];
-        auto b = 0u;
-        for (auto i = 0u; i < s.size(); ++i)
-            if (s[i] == '/') {
-                if (i - b == 2 && s[b] == '.' && s[b + 1] == '.')
-                    uol.pop_back();
+        if (f.end != no_offset)
+            in.seek(f.end);
+    }
+    // Reads the directory at the cursor into dir_node. Given first, its entries go into the
+    // count nodes from first on instead, which the caller has set aside.
+    void directory(id_t dir_node, id_t first = 0, id_t count = 0)
+    {
+        // Paths of the directories still to be read that the filter keeps at least some of
+        std::unordered_map<id_t, std::vector<std::string>> paths;
+        if (!filter.empty())
+            paths[dir_node] = dir_node == 0 ? std::vector<std::string> {}
+                                            : std::vector<std::string> { strings[nodes[dir_node].name] };
+        frames.clear();
+        push_frame({ frame::kind::directory, 0, dir_node, first, count });
+        while (!frames.empty()) {
+            auto f = frames.back();
+            frames.pop_back();
+            auto mark = frames.size();
+            auto dir = paths.find(f.node);
+            auto dropped = !filter.empty() && dir == paths.end();
+            // Stays put when the map grows, unlike the iterator
+            auto dir_path = dropped || filter.empty() ? nullptr : &dir->second;
+            auto ni = f.first;
+            if (ni == 0)
+                ni = read_children(f.node, 8);
+            else
+                in.read_cint(); // Counted by the caller already
+            auto count = f.first == 0 ? nodes[f.node].num : f.count;
+            for (auto i = 0u; i < count; ++i) {
+                auto& nn = nodes[ni + i];
+                auto type = in.read<uint8_t>();
+                switch (type) {
+                case 1:
+                    throw wz_error("Found the elusive type 1 directory", in.tell() - 1);
+                case 2: {
+                    auto s = in.read<int32_t>();
+                    auto p = in.tell();
+                    in.seek(file_start + s);
+                    type = in.read<uint8_t>();
+                    nn.name = read_enc_string();
+                    in.seek(p);
+                    break;
+                }
+                case 3:
+                case 4:
+                    nn.name = read_enc_string();
+                    break;
+                default:
+                    throw wz_error("Unknown directory type " + std::to_string(type), in.tell() - 1);
+                }
+                auto size = in.read_cint();
+                if (size < 0)
+                    throw wz_error("Directory/img has invalid size", in.tell());
+                in.read_cint(); // Offset that nobody cares about
+                in.skip(4); // Checksum that nobody cares about
+                // Dropped entries still have to be read past, the prune after parsing removes them
+                auto keep = !dropped;
+                if (keep && !filter.empty()) {
+                    auto path = *dir_path;
+                    path.push_back(strings[nn.name]);
+                    keep = filter.check(path) != path_filter::verdict::drop;
+                    if (keep && type == 3)
+                        paths[ni + i] = std::move(path);
+                }
+                if (type == 3)
+                    push_frame({ frame::kind::directory, f.depth + 1, ni + i });
+                else if (type == 4)
+                    imgs.emplace_back(keep ? ni + i : 0, size);
                 else
-                    uol.push_back(get_child(uol.back(), s.substr(b, i - b)));
-                b = ++i;
+                    throw wz_error("Unknown type 2 directory", in.tell());
             }
-        uol.push_back(get_child(uol.back(), s.substr(b)));
-        if (uol.back() == 0)
-            return false;
-        auto& nr = nodes[uol.back()];
-        if (nr.data_type == node::type::uol)
-            return false;
-        n.data_type = nr.data_type;
-        n.children = nr.children;
-        n.num = nr.num;
-        n.data.integer = nr.data.integer;
-        return true;
+            // Subdirectories are laid out one after another, so visit them in order
+            std::reverse(frames.begin() + mark, frames.end());
+            paths.erase(f.node);
+        }
     }
-    bool resolve_source(std::vector<id_t> link)
+    void extended_property(id_t prop_node, size_t p_offset)
     {
-        auto& n = nodes[link.back()];
-        link.pop_back();
-        auto& s = strings[n.data.string];
-        std::istringstream stream(s);
-        std::vector<std::string> parts;
-        std::string segment;
-        while (std::getline(stream, segment, '/'))
-            parts.push_back(segment);
-        id_t r = 0;
-        for (auto const& part : parts)
-            r = get_child_full(r, part);
-        if (r == 0)
-            return false;
-        auto& nr = nodes[r];
-        auto& pn = nodes[link.back()];
-        pn.data = nr.data;
-        return true;
-    }
-    bool resolve_outlink(std::vector<id_t> link)
-    {
-        auto& n = nodes[link.back()];
-        link.pop_back();
-        auto& s = strings[n.data.string];
-        std::istringstream stream(s);
-        std::vector<std::string> parts;
-        std::string segment;
-        while (std::getline(stream, segment, '/'))
-            parts.push_back(segment);
-        if (parts[0] == "Map")
-            return true;
-        id_t r = 0;
-        for (auto const& part : parts)
-            r = get_child_full(r, part);
-        if (r == 0)
-            return false;
-        auto& nr = nodes[r];
-        auto& pn = nodes[link.back()];
-        pn.data = nr.data;
-        return true;
-    }
-    bool resolve_inlink(std::vector<id_t> link)
-    {
-        auto& n = nodes[link.back()];
-        link.pop_back();
-        auto& s = strings[n.data.string];
-        std::istringstream stream(s);
-        std::vector<std::string> parts;
-        std::string segment;
-        while (std::getline(stream, segment, '/'))
-            parts.push_back(segment);
-        auto r = link.back();
-        auto& pn = nodes[r];
-        for (;;) {
-            // auto & p = nodes[r];
-            // auto & pn = strings[p.name];
-            for (auto const& part : parts) {
-                r = get_child_full(r, part);
-                if (r == 0)
-                    break;
-            }
-            if (r != 0)
+        frames.clear();
+        push_frame({ frame::kind::extended, 0, prop_node, 0, 0, 0, p_offset });
+        while (!frames.empty()) {
+            auto f = frames.back();
+            frames.pop_back();
+            switch (f.type) {
+            case frame::kind::extended:
+                extended_frame(f);
                 break;
-            link.pop_back();
-            if (link.size() == 0)
+            case frame::kind::property:
+                property_frame(f);
                 break;
-            r = link.back();
-        }
-        if (r == 0)
-            return false;
-        auto& nr = nodes[r];
-        pn.data = nr.data;
-        return true;
-    }
-    void uol_fail(std::vector<id_t>& uol)
-    {
-        // std::cerr << "Invalid UOL: ";
-        // for (auto id : uol) {
-        // auto & n = nodes[id];
-        // std::cerr << '/' << strings[n.name];
-        //}
-        auto& n = nodes[uol.back()];
-        if (n.data_type == node::type::uol) {
-            // std::cerr << " = \"" << strings[n.data.string] << "\"" << std::endl;
-            //  If we failed to resolve any uols, just turn them into useless empty nodes
-            n.data_type = node::type::none;
-        } else {
-            std::cerr << " claims to be an invalid UOL but isn't a UOL???" << std::endl;
+            case frame::kind::convex:
+                if (f.index < f.count) {
+                    nodes[f.first + f.index].name = add_string(std::to_string(f.index));
+                    ++f.index;
+                    push_frame(f);
+                    push_frame({ frame::kind::extended, f.depth + 1, f.first, 0, 0, 0, f.p_offset });
+                } else {
+                    finish_frame(f);
+                }
+                break;
+            case frame::kind::canvas:
+                canvas_frame(f);
+                break;
+            default:
+                throw std::runtime_error("Directory frame in a property");
+            }
         }
     }
-    void source_fail(std::vector<id_t>& link, std::string const& str)
+    void push_property(frame f)
     {
-        auto& n = nodes[link.back()];
-        std::cerr << "Failed to find " << str << " for [" << strings[n.data.string] << "]." << std::endl;
+        f.type = frame::kind::property;
+        f.first = read_children(f.node, 3);
+        f.count = nodes[f.node].num;
+        f.index = 0;
+        push_frame(f);
     }
-    void directory(id_t dir_node)
+    void canvas_frame(frame const& f)
     {
-        std::vector<id_t> directories;
-        auto& n = nodes[dir_node];
-        auto count = static_cast<id_t>(in.read_cint());
-        auto ni = static_cast<id_t>(nodes.size());
-        n.num = static_cast<uint16_t>(count);
-        n.children = ni;
-        nodes.resize(ni + count);
-        for (auto i = 0u; i < count; ++i) {
-            auto& nn = nodes[ni + i];
-            auto type = in.read<uint8_t>();
-            switch (type) {
-            case 1:
-                throw std::runtime_error("Found the elusive type 1 directory");
-            case 2: {
-                auto s = in.read<int32_t>();
-                auto p = in.tell();
-                in.seek(file_start + s);
-                type = in.read<uint8_t>();
-                nn.name = read_enc_string();
-                in.seek(p);
-                break;
-            }
-            case 3:
-            case 4:
-                nn.name = read_enc_string();
-                break;
-            default:
-                throw std::runtime_error("Unknown directory type");
-            }
-            auto size = in.read_cint();
-            if (size < 0)
-                throw std::runtime_error("Directory/img has invalid size!");
-            in.read_cint(); // Offset that nobody cares about
-            in.skip(4); // Checksum that nobody cares about
-            if (type == 3)
-                directories.push_back(ni + i);
-            else if (type == 4)
-                imgs.emplace_back(ni + i, size);
-            else
-                throw std::runtime_error("Unknown type 2 directory");
+        auto& n = nodes[f.node];
+        n.data_type = node::type::bitmap;
+        if (!media) {
+            finish_frame(f);
+            return;
         }
-        for (auto it : directories)
-            directory(it);
-        nodes_to_sort.emplace_back(ni, count);
+        n.data.bitmap.id = static_cast<uint32_t>(bitmaps.size());
+        bitmaps.push_back({ in.tell(), reinterpret_cast<uint8_t const*>(u8key) });
+        n.data.bitmap.width = static_cast<uint16_t>(in.read_cint());
+        n.data.bitmap.height = static_cast<uint16_t>(in.read_cint());
+        finish_frame(f);
     }
-    void extended_property(id_t prop_node, size_t p_offset)
+    void extended_frame(frame f)
     {
-        auto& n = nodes[prop_node];
-        auto& st = strings[read_prop_string(p_offset)];
+        auto& st = strings[read_prop_string(f.p_offset)];
+        auto& n = nodes[f.node];
         if (st == "Property") {
             in.skip(2);
-            sub_property(prop_node, p_offset);
+            push_property(f);
         } else if (st == "Canvas") {
             in.skip(1);
             if (in.read<uint8_t>() == 1) {
                 in.skip(2);
-                sub_property(prop_node, p_offset);
-            }
-            // Have to recalculate n, because address may have changed
-            // because sub_property may increase the size of nodes
-            auto& nn = nodes[prop_node];
-            nn.data_type = node::type::bitmap;
-            nn.data.bitmap.id = static_cast<uint32_t>(bitmaps.size());
-            bitmaps.push_back({ in.tell(), reinterpret_cast<uint8_t const*>(u8key) });
-            nn.data.bitmap.width = static_cast<uint16_t>(in.read_cint());
-            nn.data.bitmap.height = static_cast<uint16_t>(in.read_cint());
+                f.type = frame::kind::canvas;
+                push_frame(f);
+                ++f.depth;
+                f.end = no_offset;
+                push_property(f);
+            } else {
+                canvas_frame(f);
+            }
         } else if (st == "Shape2D#Vector2D") {
             n.data_type = node::type::vector;
             n.data.vector[0] = in.read_cint();
             n.data.vector[1] = in.read_cint();
+            finish_frame(f);
         } else if (st == "Shape2D#Convex2D") {
-            auto count = static_cast<id_t>(in.read_cint());
-            auto ni = static_cast<id_t>(nodes.size());
-            n.num = static_cast<uint16_t>(count);
-            n.children = ni;
-            nodes.resize(nodes.size() + count);
-            for (auto i = 0u; i < count; ++i) {
-                auto& nn = nodes[ni + i];
-                auto es = std::to_string(i);
-                nn.name = add_string(std::move(es));
-                extended_property(ni, p_offset);
-            }
-            nodes_to_sort.emplace_back(ni, count);
+            f.type = frame::kind::convex;
+            f.first = read_children(f.node, 2);
+            f.count = nodes[f.node].num;
+            f.index = 0;
+            push_frame(f);
         } else if (st == "Sound_DX8") {
             n.data_type = node::type::audio;
+            if (!media) {
+                finish_frame(f);
+                return;
+            }
             n.data.audio.id = static_cast<uint32_t>(audios.size());
             audio a;
             in.skip(1); // Always 0
@@ -768,26 +2161,25 @@ struct wztonx {
             n.data.audio.length = a.length;
             in.read_cint();
             a.data = in.tell();
+            if (a.length > in.remaining())
+                throw wz_error("Sound runs past the end of the img", a.data);
             audios.push_back(a);
+            finish_frame(f);
         } else if (st == "UOL") {
             in.skip(1);
             n.data_type = node::type::uol;
-            n.data.string = read_prop_string(p_offset);
+            n.data.string = read_prop_string(f.p_offset);
+            finish_frame(f);
         } else {
-            throw std::runtime_error("Unknown sub property type: " + st);
+            throw wz_error("Unknown sub property type " + st, in.tell());
         }
     }
-    void sub_property(id_t prop_node, size_t p_offset)
+    void property_frame(frame f)
     {
-        auto& n = nodes[prop_node];
-        auto count = static_cast<id_t>(in.read_cint());
-        auto ni = static_cast<id_t>(nodes.size());
-        n.num = static_cast<uint16_t>(count);
-        n.children = ni;
-        nodes.resize(nodes.size() + count);
-        for (auto i = 0u; i < count; ++i) {
-            auto& nn = nodes[ni + i];
-            nn.name = read_prop_string(p_offset);
+        for (; f.index < f.count; ++f.index) {
+            auto i = f.index;
+            auto& nn = nodes[f.first + i];
+            nn.name = read_prop_string(f.p_offset);
             auto type = in.read<uint8_t>();
             uint8_t num;
             size_t p;
@@ -820,13 +2212,18 @@ struct wztonx {
                 break;
             case 0x08:
                 nn.data_type = node::type::string;
-                nn.data.string = read_prop_string(p_offset);
+                nn.data.string = read_prop_string(f.p_offset);
                 break;
             case 0x09:
-                p = in.read<int32_t>() + in.tell();
-                extended_property(ni + i, p_offset);
-                in.seek(p);
-                break;
+                p = in.read<uint32_t>();
+                if (p > in.remaining())
+                    throw wz_error("Property runs past the end of the img", in.tell());
+                p += in.tell();
+                // Suspend this list and pick it up again once the child is done
+                ++f.index;
+                push_frame(f);
+                push_frame({ frame::kind::extended, f.depth + 1, f.first + i, 0, 0, 0, f.p_offset, p });
+                return;
             case 0x13:
                 nn.data_type = node::type::integer;
                 nn.data.integer = in.read_cint();
@@ -841,33 +2238,35 @@ struct wztonx {
                 }
                 break;
             default:
-                throw std::runtime_error("Unknown sub property type: " + std::to_string(type));
+                throw wz_error("Unknown sub property type " + std::to_string(type), in.tell() - 1);
             }
         }
-        nodes_to_sort.emplace_back(ni, count);
+        finish_frame(f);
     }
     void img(id_t img_node, int32_t size)
     {
         auto p = in.tell();
+        // Nothing in an img may point outside of it
+        auto outer = in.enter(static_cast<size_t>(size));
         auto n1 = in.read<uint8_t>();
         if (n1 == 1) {
             lua_script(img_node);
         } else {
-            deduce_key();
+            deduce_key([&] { sample_property(p); });
             in.seek(p);
             extended_property(img_node, p);
         }
+        in.leave(outer);
         in.seek(p + size);
     }
     void lua_script(id_t script_node)
     {
         auto slen = static_cast<uint32_t>(in.read_cint());
         if (slen > 0x1ffff)
-            throw std::runtime_error("Lua script is too long");
-        auto os = reinterpret_cast<char8_t const*>(in.offset);
+            throw wz_error("Lua script is too long", in.tell());
+        auto os = reinterpret_cast<char8_t const*>(in.view(slen));
         str_buf.resize(slen);
-        auto key = key_kms;
-        u8key = reinterpret_cast<char8_t const*>(key);
+        u8key = reinterpret_cast<char8_t const*>(::Key::get(::Key::kms_iv).data());
         for (auto i = 0u; i < slen; ++i) {
             str_buf[i] = static_cast<char8_t>(os[i] ^ u8key[i]);
         }
@@ -876,420 +2275,2005 @@ struct wztonx {
         n.data_type = node::type::string;
         n.data.string = string;
     }
-    virtual void parse_file()
+};
+// Encoded canvases kept on disk by a hash of their input, so identical canvases are only ever
+// encoded once, whichever file or run they come from. Every blob is a file of its own that
+// only appears once completely written, so any number of processes can share the directory.
+// Hits refresh the file's time, and trim removes the stalest files once the size is exceeded.
+struct blob_cache {
+    static constexpr uint32_t magic = 0x3142584e; // NXB1
+    struct header {
+        uint32_t magic;
+        uint32_t size;
+        uint64_t check;
+    };
+    // Temporary files this old were left behind by a process that died while writing them
+    static constexpr time_t stale = 60 * 60;
+    std::string dir;
+    uint64_t limit = 0;
+    std::mutex trim_mutex;
+    // Bytes put since the last trim, not yet added to the size kept in the lock file
+    std::atomic<uint64_t> added { 0 };
+#ifdef _WIN32
+    blob_cache(std::string, uint64_t)
     {
-        std::cerr << "Working on " << wzfilename << std::endl;
-        std::cout << "Parsing input.......";
-        in.open(wzfilename);
-        auto magic = in.read<uint32_t>();
-        if (magic != 0x31474B50)
-            throw std::runtime_error("Not a valid WZ file");
-        in.skip(8);
-        file_start = in.read<uint32_t>();
-        // Just skip the copyright string
-        in.seek(file_start + 2);
-        in.read_cint();
-        in.skip(1);
-        deduce_key();
-        in.seek(file_start + 2);
-        add_string({});
-        directory(0);
-        for (auto& it : imgs)
-            img(it.first, it.second);
-        std::cout << "Done!" << std::endl;
-        finish_parse();
+        throw std::runtime_error("The bitmap cache is not supported on Windows");
     }
-    void finish_parse()
+    bool get(uint64_t, std::vector<uint8_t>&, uint32_t&) { return false; }
+    void put(uint64_t, uint8_t const*, uint32_t) { }
+    void trim() { }
+#else
+    blob_cache(std::string d, uint64_t limit)
+        : dir(std::move(d))
+        , limit(limit)
     {
-        for (auto const& n : nodes_to_sort)
-            sort_nodes(n.first, n.second);
-        std::cout << "Parsing uol.........";
-        // uol
-        find_uols(0);
-        for (;;) {
-            auto it = std::remove_if(uols.begin(), uols.end(), [this](std::vector<id_t> const& v) {
-                return resolve_uol(v);
-            });
-            auto diff = uols.end() - it;
-            uols.erase(it, uols.end());
-            if (diff == 0)
-                break;
-        }
-        for (auto& it : uols)
-            uol_fail(it);
-        std::cout << "Done!" << std::endl;
-        // source
-        std::cout << "Parsing source......";
-        find_links(0, "source");
-        for (;;) {
-            auto it = std::remove_if(links.begin(), links.end(), [this](std::vector<id_t> const& v) {
-                return resolve_source(v);
-            });
-            auto diff = links.end() - it;
-            links.erase(it, links.end());
-            if (diff == 0)
-                break;
-        }
-        for (auto& it : links)
-            source_fail(it, "source");
-        links.clear();
-        std::cout << "Done!" << std::endl;
-        //_outlink
-        std::cout << "Parsing _outlink....";
-        find_links(0, "_outlink");
-        for (;;) {
-            auto it = std::remove_if(links.begin(), links.end(), [this](std::vector<id_t> const& v) {
-                return resolve_outlink(v);
-            });
-            auto diff = links.end() - it;
-            links.erase(it, links.end());
-            if (diff == 0)
-                break;
-        }
-        for (auto& it : links)
-            source_fail(it, "_outlink");
-        links.clear();
-        std::cout << "Done!" << std::endl;
-        //_inlink
-        std::cout << "Parsing _inlink.....";
-        find_links(0, "_inlink");
-        for (;;) {
-            auto it = std::remove_if(links.begin(), links.end(), [this](std::vector<id_t> const& v) {
-                return resolve_inlink(v);
-            });
-            auto diff = links.end() - it;
-            links.erase(it, links.end());
-            if (diff == 0)
-                break;
-        }
-        for (auto& it : links)
-            source_fail(it, "_inlink");
-        links.clear();
-        std::cout << "Done!" << std::endl;
+        mkdir(dir.c_str(), 0777);
     }
-    void calculate_offsets()
+    std::string path(uint64_t hash) const
     {
-        offset = 0;
-        offset += 52;
-        offset += 0x10 - (offset & 0xf);
-        node_offset = offset;
-        offset += nodes.size() * 20;
-        offset += 0x10 - (offset & 0xf);
-        string_table_offset = offset;
-        offset += strings.size() * 8;
-        offset += 0x10 - (offset & 0xf);
-        string_offset = offset;
-        offset += std::accumulate(strings.begin(), strings.end(), 0ull,
-            [](size_t n, std::string const& s) {
-                return n + s.size() + 2 + (s.size() & 1 ? 1 : 0);
-            });
-        offset += 0x10 - (offset & 0xf);
-        audio_table_offset = offset;
-        if (client) {
-            offset += audios.size() * 8;
-            offset += 0x10 - (offset & 0xf);
-        }
-        bitmap_table_offset = offset;
-        if (client) {
-            offset += bitmaps.size() * 8;
-            offset += 0x10 - (offset & 0xf);
+        char name[20];
+        std::snprintf(name, sizeof(name), "%02x/%014llx", static_cast<unsigned>(hash >> 56),
+            static_cast<unsigned long long>(hash & 0xffffffffffffffull));
+        return dir + "/" + name;
+    }
+    bool get(uint64_t hash, std::vector<uint8_t>& blob, uint32_t& size)
+    {
+        auto p = path(hash);
+        auto handle = ::open(p.c_str(), O_RDONLY);
+        if (handle == -1)
+            return false;
+        header h;
+        struct stat st;
+        auto ok = ::read(handle, &h, sizeof(h)) == sizeof(h) && h.magic == magic;
+        // The size is only believed once the file is known to be that big, a damaged entry
+        // could otherwise ask for gigabytes
+        ok = ok && fstat(handle, &st) == 0 && h.size <= static_cast<uint64_t>(st.st_size) - sizeof(h);
+        if (ok) {
+            blob.resize(h.size);
+            ok = ::read(handle, blob.data(), h.size) == static_cast<ssize_t>(h.size)
+                && hash64(blob.data(), h.size, hash) == h.check;
         }
-        audio_offset = offset;
-        if (client) {
-            offset += std::accumulate(audios.begin(), audios.end(), 0ull,
-                [](size_t n, audio const& a) { return n + a.length; });
-            offset += 0x10 - (offset & 0xf);
+        if (ok)
+            futimens(handle, nullptr);
+        close(handle);
+        if (!ok) {
+            unlink(p.c_str());
+            return false;
         }
-        bitmap_offset = offset;
+        size = h.size;
+        return true;
     }
-    void open_output()
+    // Failing to cache is never an error, the blob just gets encoded again next time
+    void put(uint64_t hash, uint8_t const* blob, uint32_t size)
     {
-        std::cout << "Opening output......";
-        calculate_offsets();
-        out.open(nxfilename, offset);
-        out.seek(0);
-        out.write<uint32_t>(0x34474B50);
-        out.write<uint32_t>(static_cast<uint32_t>(nodes.size()));
-        out.write<uint64_t>(node_offset);
-        out.write<uint32_t>(static_cast<uint32_t>(strings.size()));
-        out.write<uint64_t>(string_table_offset);
-        if (client) {
-            out.write<uint32_t>(static_cast<uint32_t>(bitmaps.size()));
-            out.write<uint64_t>(bitmap_table_offset);
-            out.write<uint32_t>(static_cast<uint32_t>(audios.size()));
-            out.write<uint64_t>(audio_table_offset);
-        } else {
-            out.write<uint32_t>(0);
-            out.write<uint64_t>(0);
-            out.write<uint32_t>(0);
-            out.write<uint64_t>(0);
+        auto p = path(hash);
+        auto temp = p + ".XXXXXX";
+        auto handle = mkstemp(&temp[0]);
+        if (handle == -1 && errno == ENOENT) {
+            mkdir(p.substr(0, p.rfind('/')).c_str(), 0777);
+            temp = p + ".XXXXXX";
+            handle = mkstemp(&temp[0]);
         }
-        std::cout << "Done!" << std::endl;
+        if (handle == -1)
+            return;
+        header h { magic, size, hash64(blob, size, hash) };
+        auto ok = ::write(handle, &h, sizeof(h)) == sizeof(h)
+            && ::write(handle, blob, size) == static_cast<ssize_t>(size);
+        // mkstemp makes the file private, give it the permissions a new file would get
+        fchmod(handle, new_file_mode());
+        close(handle);
+        if (!ok || rename(temp.c_str(), p.c_str()) != 0)
+            unlink(temp.c_str());
+        else
+            added += sizeof(h) + size;
     }
-    void write_nodes()
+    // Keeps the cache within its limit. The lock file holds the size of the cache, which every
+    // process adds what it put to, so the cache only has to be walked once that goes over the
+    // limit, or when there is no size yet.
+    void trim()
     {
-        std::cout << "Writing nodes.......";
-        out.seek(node_offset);
-        out.write(nodes.data(), nodes.size() * 20);
-        std::cout << "Done!" << std::endl;
+        std::lock_guard<std::mutex> guard { trim_mutex };
+        auto lock_path = dir + "/lock";
+        auto lock = ::open(lock_path.c_str(), O_RDWR | O_CREAT, 0666);
+        if (lock == -1)
+            return;
+        if (flock(lock, LOCK_EX) != 0) {
+            close(lock);
+            return;
+        }
+        uint64_t total = 0;
+        auto known = ::pread(lock, &total, sizeof(total), 0) == sizeof(total);
+        total += added.exchange(0);
+        if (!known || total > limit)
+            total = walk();
+        if (::pwrite(lock, &total, sizeof(total), 0) != sizeof(total))
+            ftruncate(lock, 0);
+        close(lock);
     }
-    void write_strings()
+    // Removes the least recently used blobs until the cache fits its limit again, and returns
+    // the size that is left
+    uint64_t walk()
     {
-        std::cout << "Writing strings.....";
-        out.seek(string_table_offset);
-        auto next_str = string_offset;
-        for (auto const& s : strings) {
-            out.write<uint64_t>(next_str);
-            next_str += s.size() + 2;
-            if (s.size() & 1)
-                ++next_str;
+        struct entry {
+            time_t time;
+            uint64_t size;
+            std::string path;
+        };
+        std::vector<entry> entries;
+        uint64_t total = 0;
+        auto now = time(nullptr);
+        for (auto top = 0; top < 0x100; ++top) {
+            char name[4];
+            std::snprintf(name, sizeof(name), "%02x", top);
+            auto sub = dir + "/" + name;
+            auto d = opendir(sub.c_str());
+            if (!d)
+                continue;
+            while (auto e = readdir(d)) {
+                auto p = sub + "/" + e->d_name;
+                struct stat finfo;
+                if (::stat(p.c_str(), &finfo) != 0 || !S_ISREG(finfo.st_mode))
+                    continue;
+                if (std::strchr(e->d_name, '.')) {
+                    if (now - finfo.st_mtime > stale)
+                        unlink(p.c_str());
+                    continue;
+                }
+                entries.push_back({ finfo.st_mtime, static_cast<uint64_t>(finfo.st_size), std::move(p) });
+                total += static_cast<uint64_t>(finfo.st_size);
+            }
+            closedir(d);
         }
-        out.seek(string_offset);
-        for (auto const& s : strings) {
-            out.write<uint16_t>(static_cast<uint16_t>(s.size()));
-            out.write(s.data(), s.size());
-            if (s.size() & 1)
-                out.skip(1);
+        if (total > limit) {
+            // Going a little under the limit keeps every conversion from having to trim again
+            std::sort(entries.begin(), entries.end(),
+                [](entry const& l, entry const& r) { return l.time < r.time; });
+            for (auto& e : entries) {
+                if (total <= limit - limit / 8)
+                    break;
+                if (unlink(e.path.c_str()) == 0)
+                    total -= e.size;
+            }
         }
-        std::cout << "Done!" << std::endl;
+        return total;
     }
-    void write_audio()
-    {
-        std::cout << "Writing audio.......";
-        out.seek(audio_table_offset);
+#endif
+};
+// What an earlier conversion made of each img and canvas, kept next to the NX so the next
+// conversion only has to redo the ones that changed. Entries are found by a hash of the
+// input bytes they came from, so renamed or moved imgs are still found.
+struct manifest {
+    static constexpr uint32_t magic = 0x314d584e; // NXM1
+    static constexpr uint32_t version = 1;
+    // Where an encoded canvas is in the NX, with a hash to check it is still there
+    struct blob {
+        uint64_t offset;
+        uint32_t size;
+        uint64_t check;
+    };
+    uint32_t flags = 0;
+    uint64_t nx_size = 0;
+    std::unordered_map<uint64_t, std::string, identity<uint64_t>> imgs;
+    std::unordered_map<uint64_t, blob, identity<uint64_t>> blobs;
+    // Bounds checked reads of what was written with put
+    struct reader {
+        char const* p;
+        char const* end;
+        template <typename T>
+        T get()
+        {
+            T v;
+            std::memcpy(&v, take(sizeof(T)), sizeof(T));
+            return v;
+        }
+        char const* take(size_t n)
+        {
+            if (static_cast<size_t>(end - p) < n)
+                throw std::runtime_error("Truncated manifest");
+            p += n;
+            return p - n;
+        }
+    };
+    template <typename T>
+    static void put(std::string& s, T const& v)
+    {
+        s.append(reinterpret_cast<char const*>(&v), sizeof(T));
+    }
+    // Anything wrong with the file just means starting from scratch
+    bool load(std::string const& p)
+    {
+        imgs.clear();
+        blobs.clear();
+        auto f = std::ifstream { p, std::ios::binary };
+        if (!f.is_open())
+            return false;
+        auto s = std::string { std::istreambuf_iterator<char> { f }, {} };
+        if (s.size() < 8)
+            return false;
+        uint64_t check;
+        std::memcpy(&check, s.data() + s.size() - 8, 8);
+        if (hash64(s.data(), s.size() - 8, magic) != check)
+            return false;
+        try {
+            auto r = reader { s.data(), s.data() + s.size() - 8 };
+            if (r.get<uint32_t>() != magic || r.get<uint32_t>() != version)
+                return false;
+            flags = r.get<uint32_t>();
+            nx_size = r.get<uint64_t>();
+            for (auto n = r.get<uint64_t>(); n > 0; --n) {
+                auto hash = r.get<uint64_t>();
+                auto size = r.get<uint32_t>();
+                imgs[hash].assign(r.take(size), size);
+            }
+            for (auto n = r.get<uint64_t>(); n > 0; --n) {
+                auto hash = r.get<uint64_t>();
+                auto& b = blobs[hash];
+                b.offset = r.get<uint64_t>();
+                b.size = r.get<uint32_t>();
+                b.check = r.get<uint64_t>();
+            }
+        } catch (std::runtime_error const&) {
+            imgs.clear();
+            blobs.clear();
+            return false;
+        }
+        return true;
+    }
+    // Written beside the old one and renamed over it, so a crash leaves one or the other
+    void save(std::string const& p) const
+    {
+        std::string s;
+        put(s, magic);
+        put(s, version);
+        put(s, flags);
+        put(s, nx_size);
+        put(s, static_cast<uint64_t>(imgs.size()));
+        for (auto& it : imgs) {
+            put(s, it.first);
+            put(s, static_cast<uint32_t>(it.second.size()));
+            s += it.second;
+        }
+        put(s, static_cast<uint64_t>(blobs.size()));
+        for (auto& it : blobs) {
+            put(s, it.first);
+            put(s, it.second.offset);
+            put(s, it.second.size);
+            put(s, it.second.check);
+        }
+        put(s, hash64(s.data(), s.size(), magic));
+        auto temp = p + ".tmp";
+        {
+            auto f = std::ofstream { temp, std::ios::binary | std::ios::trunc };
+            f.write(s.data(), static_cast<std::streamsize>(s.size()));
+            if (!f.flush())
+                throw std::runtime_error("Failed to write " + temp);
+        }
+        sys::rename(temp, p);
+    }
+};
+// The main class itself
+struct wztonx : parser {
+    // Variables
+    imapfile file;
+    window_source source;
+    omapfile out;
+    std::vector<id_t> uol_path;
+    std::vector<std::vector<id_t>> uols;
+    std::vector<id_t> link_path;
+    std::vector<std::vector<id_t>> links;
+    size_t offset, node_offset, string_offset, string_table_offset, bitmap_offset,
+        bitmap_table_offset, audio_offset, audio_table_offset, extension_offset;
+    // Sections to write besides the standard ones, see nx_extension
+    bool child_index = false;
+    bool string_hash_section = false;
+    std::vector<nx_extension> extensions;
+    // Parents with enough children to be worth a hash table, and where their slots start
+    static constexpr uint16_t child_index_min = 32;
+    std::vector<std::pair<id_t, uint32_t>> child_groups;
+    uint32_t child_slots = 0;
+    bool client, hc;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    // Shared with the other files being converted, work runs inline without one
+    task_pool* pool = nullptr;
+    bool populate = false;
+    // Bytes of the input to keep mapped at most, 0 maps all of it. Only the input is held to
+    // it, the node and string tables and the output still grow with the file.
+    size_t memory = 0;
+    // Only redo the imgs and canvases that changed since the conversion in the manifest
+    bool incremental = false;
+    manifest previous, next;
+    std::unique_ptr<imapfile> old_nx;
+    // Shared with the other files being converted, and with other processes through the disk
+    blob_cache* cache = nullptr;
+    // Write identical canvases only once
+    bool dedupe = false;
+    // Reorder the nodes for lookups, following the paths in layout_profile first if set
+    bool layout = false;
+    std::string layout_profile;
+    // Server output with variable width nodes, see compact_record
+    bool compact = false;
+    // Leave out the imgs and directories that are nothing but canvases and sounds
+    bool drop_image_only = false;
+    // What bitmaps are compressed with, high follows hc
+    bitmap_codec codec;
+    std::string wzfilename, nxfilename;
+    // Methods
+    void open_input()
+    {
+        if (memory || !sys::is_regular_file(wzfilename)) {
+            source.open({ wzfilename }, memory);
+            in = {};
+            in.source = &source;
+            in.file_size = in.end = source.file_size;
+        } else {
+            file.open(wzfilename, populate);
+            file.advise_sequential();
+            in = file;
+        }
+    }
+    void sort_nodes(id_t first, id_t count)
+    {
+        std::sort(nodes.begin() + first, nodes.begin() + first + count,
+            [this](node const& n1, node const& n2) {
+                return strings[n1.name] < strings[n2.name];
+            });
+    }
+    void find_uols(id_t uol_node)
+    {
+        auto& n = nodes[uol_node];
+        if (n.data_type == node::type::uol) {
+            uol_path.push_back(uol_node);
+            uols.push_back(uol_path);
+            uol_path.pop_back();
+        } else if (n.num != 0) {
+            uol_path.push_back(uol_node);
+            for (auto i = 0u; i < n.num; ++i)
+                find_uols(n.children + i);
+            uol_path.pop_back();
+        }
+    }
+    // std::vector<std::string> name_path;
+    void find_links(id_t link_node, std::string const& str)
+    {
+        auto& n = nodes[link_node];
+        auto& s = strings[n.name];
+        if (s == str) {
+            link_path.push_back(link_node);
+            // name_path.push_back(s);
+            links.push_back(link_path);
+            link_path.pop_back();
+            // name_path.pop_back();
+        } else if (n.num != 0) {
+            link_path.push_back(link_node);
+            // name_path.push_back(s);
+            for (auto i = 0u; i < n.num; ++i)
+                find_links(n.children + i, str);
+            link_path.pop_back();
+            // name_path.pop_back();
+        }
+    }
+    id_t get_child(id_t parent_node, std::string const& str)
+    {
+        if (parent_node == 0)
+            return 0;
+        auto& n = nodes[parent_node];
+        auto first = nodes.begin() + n.children;
+        auto last = first + n.num;
+        auto it = std::lower_bound(first, last, str, [this](node const& n, std::string const& s) {
+            return strings[n.name] < s;
+        });
+        if (it == last)
+            return 0;
+        if (strings[it->name] != str)
+            return 0;
+        return static_cast<id_t>(it - nodes.begin());
+    }
+    id_t get_child_full(id_t parent_node, std::string const& str)
+    {
+        auto& n = nodes[parent_node];
+        auto first = nodes.begin() + n.children;
+        auto last = first + n.num;
+        auto it = std::lower_bound(first, last, str, [this](node const& n, std::string const& s) {
+            return strings[n.name] < s;
+        });
+        if (it == last)
+            return 0;
+        if (strings[it->name] != str)
+            return 0;
+        return static_cast<id_t>(it - nodes.begin());
+    }
+    bool resolve_uol(std::vector<id_t> uol)
+    {
+        auto& n = nodes[uol.back()];
+        uol.pop_back();
+        if (n.data_type != node::type::uol)
+            throw std::runtime_error("Welp. I failed.");
+        auto& s = strings[n.data.string];
+        auto b = 0u;
+        for (auto i = 0u; i < s.size(); ++i)
+            if (s[i] == '/') {
+                if (i - b == 2 && s[b] == '.' && s[b + 1] == '.')
+                    uol.pop_back();
+                else
+                    uol.push_back(get_child(uol.back(), s.substr(b, i - b)));
+                b = ++i;
+            }
+        uol.push_back(get_child(uol.back(), s.substr(b)));
+        if (uol.back() == 0)
+            return false;
+        auto& nr = nodes[uol.back()];
+        if (nr.data_type == node::type::uol)
+            return false;
+        n.data_type = nr.data_type;
+        n.children = nr.children;
+        n.num = nr.num;
+        n.data.integer = nr.data.integer;
+        return true;
+    }
+    bool resolve_source(std::vector<id_t> link)
+    {
+        auto& n = nodes[link.back()];
+        link.pop_back();
+        auto& s = strings[n.data.string];
+        std::istringstream stream(s);
+        std::vector<std::string> parts;
+        std::string segment;
+        while (std::getline(stream, segment, '/'))
+            parts.push_back(segment);
+        id_t r = 0;
+        for (auto const& part : parts)
+            r = get_child_full(r, part);
+        if (r == 0)
+            return false;
+        auto& nr = nodes[r];
+        auto& pn = nodes[link.back()];
+        pn.data = nr.data;
+        return true;
+    }
+    bool resolve_outlink(std::vector<id_t> link)
+    {
+        auto& n = nodes[link.back()];
+        link.pop_back();
+        auto& s = strings[n.data.string];
+        std::istringstream stream(s);
+        std::vector<std::string> parts;
+        std::string segment;
+        while (std::getline(stream, segment, '/'))
+            parts.push_back(segment);
+        if (parts[0] == "Map")
+            return true;
+        id_t r = 0;
+        for (auto const& part : parts)
+            r = get_child_full(r, part);
+        if (r == 0)
+            return false;
+        auto& nr = nodes[r];
+        auto& pn = nodes[link.back()];
+        pn.data = nr.data;
+        return true;
+    }
+    bool resolve_inlink(std::vector<id_t> link)
+    {
+        auto& n = nodes[link.back()];
+        link.pop_back();
+        auto& s = strings[n.data.string];
+        std::istringstream stream(s);
+        std::vector<std::string> parts;
+        std::string segment;
+        while (std::getline(stream, segment, '/'))
+            parts.push_back(segment);
+        auto r = link.back();
+        auto& pn = nodes[r];
+        for (;;) {
+            // auto & p = nodes[r];
+            // auto & pn = strings[p.name];
+            for (auto const& part : parts) {
+                r = get_child_full(r, part);
+                if (r == 0)
+                    break;
+            }
+            if (r != 0)
+                break;
+            link.pop_back();
+            if (link.size() == 0)
+                break;
+            r = link.back();
+        }
+        if (r == 0)
+            return false;
+        auto& nr = nodes[r];
+        pn.data = nr.data;
+        return true;
+    }
+    // Whether the target of a link that failed to resolve is somewhere the filter dropped.
+    // The target is relative to the first length nodes of chain, which starts at the root.
+    bool filtered_out(std::vector<id_t> const& chain, size_t length, std::string const& target)
+    {
+        std::vector<std::string> path;
+        for (auto i = size_t { 1 }; i < length; ++i)
+            path.push_back(strings[nodes[chain[i]].name]);
+        std::istringstream stream(target);
+        std::string part;
+        while (std::getline(stream, part, '/')) {
+            if (part != "..")
+                path.push_back(part);
+            else if (!path.empty())
+                path.pop_back();
+        }
+        return filter.check(path) == path_filter::verdict::drop;
+    }
+    void uol_fail(std::vector<id_t>& uol)
+    {
+        // std::cerr << "Invalid UOL: ";
+        // for (auto id : uol) {
+        // auto & n = nodes[id];
+        // std::cerr << '/' << strings[n.name];
+        //}
+        auto& n = nodes[uol.back()];
+        if (n.data_type == node::type::uol) {
+            // std::cerr << " = \"" << strings[n.data.string] << "\"" << std::endl;
+            auto& s = strings[n.data.string];
+            if (!filter.empty() && filtered_out(uol, uol.size() - 1, s))
+                std::cerr << "Failed to find UOL [" << s << "], it points at what the filter dropped." << std::endl;
+            //  If we failed to resolve any uols, just turn them into useless empty nodes
+            n.data_type = node::type::none;
+        } else {
+            std::cerr << " claims to be an invalid UOL but isn't a UOL???" << std::endl;
+        }
+    }
+    void source_fail(std::vector<id_t>& link, std::string const& str)
+    {
+        auto& n = nodes[link.back()];
+        auto& s = strings[n.data.string];
+        std::cerr << "Failed to find " << str << " for [" << s << "]";
+        // _inlink is tried from every parent, the others are from the root
+        auto dropped = false;
+        for (auto i = str == "_inlink" ? link.size() - 1 : 1; !filter.empty() && !dropped && i > 0; --i)
+            dropped = filtered_out(link, i, s);
+        if (dropped)
+            std::cerr << ", it points at what the filter dropped";
+        std::cerr << "." << std::endl;
+    }
+    virtual void parse_file()
+    {
+        std::cerr << "Working on " << wzfilename << std::endl;
+        *progress << "Parsing input.......";
+        phase ph;
+        open_input();
+        // A rough guess at how many nodes the file holds, so the arena rarely has to grow
+        nodes.reserve(in.size() / 64);
+        auto magic = in.read<uint32_t>();
+        if (magic != 0x31474B50)
+            throw wz_error("Not a valid WZ file", 0);
+        in.skip(8);
+        file_start = in.read<uint32_t>();
+        // Just skip the copyright string
+        in.seek(file_start + 2);
+        auto entries = in.read_cint();
+        in.skip(1);
+        deduce_key([&] { sample_directory(entries); });
+        in.seek(file_start + 2);
+        add_string({});
+        directory(0);
+        parse_imgs();
+        ph.done();
+        finish_parse();
+    }
+    // Where the parts of one img ended up inside the arena that parsed it
+    struct img_span {
+        size_t arena;
+        id_t root, node_end;
+        id_t string_first, string_end;
+        size_t sort_first, sort_end;
+        size_t bitmap_first, bitmap_end;
+        size_t audio_first, audio_end;
+    };
+    std::string manifest_path() const { return nxfilename + ".manifest"; }
+    void load_manifest()
+    {
+        auto flags = uint32_t { client } | uint32_t { hc } << 1 | uint32_t { !media } << 2
+            | uint32_t { codec.type } << 3;
+        next.flags = flags;
+        if (!previous.load(manifest_path()) || previous.flags != flags) {
+            previous = {};
+            return;
+        }
+        std::error_code ec;
+        if (client && sys::file_size(nxfilename, ec) == previous.nx_size && !ec) {
+            old_nx = std::make_unique<imapfile>();
+            old_nx->open(nxfilename);
+        } else {
+            previous.blobs.clear();
+        }
+    }
+    void save_manifest()
+    {
+        next.nx_size = sys::file_size(nxfilename);
+        next.save(manifest_path());
+    }
+    // Hashes length bytes at n in pieces, so big ones need no window of their own
+    static uint64_t hash_range(icursor& c, size_t n, size_t length, uint64_t seed)
+    {
+        c.seek(n);
+        for (size_t done = 0; done < length;) {
+            auto piece = std::min<size_t>(length - done, window_source::overlap);
+            seed = hash64(c.view(piece), piece, seed);
+            done += piece;
+        }
+        return seed;
+    }
+    static ::Key::IV key_iv(uint8_t const* key)
+    {
+        for (auto k : keys)
+            if (k->data(0) == key)
+                return k->iv();
+        throw std::runtime_error("Canvas with an unknown key");
+    }
+    // Parsing an img depends on nothing but its bytes, see deduce_key
+    uint64_t img_hash(icursor& c, size_t start, int32_t size) const
+    {
+        return hash_range(c, start, static_cast<size_t>(size), static_cast<uint64_t>(size));
+    }
+    // The header and payload of a canvas and the key they are encrypted with. 0 when the
+    // header is broken, which encode_bitmap reports.
+    uint64_t bitmap_hash(icursor& c, uint32_t index) const
+    {
+        auto& b = bitmaps[index];
+        c.seek(b.data);
+        c.read_cint();
+        c.read_cint();
+        c.read_cint();
+        c.skip(5);
+        auto length = size_t { c.read<uint32_t>() } + 1;
+        if (length > c.remaining())
+            return 0;
+        auto iv = key_iv(b.key);
+        auto seed = hash64(iv.data(), iv.size(), uint64_t { hc } | uint64_t { codec.type } << 1);
+        // A blob compressed with one dictionary is no good with any other
+        if (!codec.dictionary.empty())
+            seed = hash64(codec.dictionary.data(), codec.dictionary.size(), seed);
+        return hash_range(c, b.data, c.tell() + length - b.data, seed);
+    }
+    // An img's share of arena a, with every id made relative to the img so it can be merged
+    // into any conversion later on
+    std::string save_fragment(parser& a, img_span const& s, size_t start) const
+    {
+        std::string f;
+        auto string_id = [&](id_t id) { return id == 0 ? id : id - s.string_first + 1; };
+        manifest::put(f, static_cast<uint32_t>(s.node_end - s.root));
+        manifest::put(f, static_cast<uint32_t>(s.string_end - s.string_first));
+        manifest::put(f, static_cast<uint32_t>(s.sort_end - s.sort_first));
+        manifest::put(f, static_cast<uint32_t>(s.bitmap_end - s.bitmap_first));
+        manifest::put(f, static_cast<uint32_t>(s.audio_end - s.audio_first));
+        for (auto i = s.root; i < s.node_end; ++i) {
+            auto n = a.nodes[i];
+            n.name = string_id(n.name);
+            n.children = n.children > s.root ? n.children - s.root : 0;
+            switch (n.data_type) {
+            case node::type::string:
+            case node::type::uol:
+                n.data.string = string_id(n.data.string);
+                break;
+            case node::type::bitmap:
+                n.data.bitmap.id = static_cast<uint32_t>(n.data.bitmap.id - s.bitmap_first);
+                break;
+            case node::type::audio:
+                n.data.audio.id = static_cast<uint32_t>(n.data.audio.id - s.audio_first);
+                break;
+            default:
+                break;
+            }
+            manifest::put(f, n);
+        }
+        for (auto i = s.string_first; i < s.string_end; ++i) {
+            manifest::put(f, static_cast<uint32_t>(a.strings[i].size()));
+            f += a.strings[i];
+        }
+        for (auto i = s.sort_first; i < s.sort_end; ++i) {
+            manifest::put(f, a.nodes_to_sort[i].first - s.root);
+            manifest::put(f, a.nodes_to_sort[i].second);
+        }
+        for (auto i = s.bitmap_first; i < s.bitmap_end; ++i) {
+            manifest::put(f, a.bitmaps[i].data - start);
+            manifest::put(f, key_iv(a.bitmaps[i].key));
+        }
+        for (auto i = s.audio_first; i < s.audio_end; ++i) {
+            manifest::put(f, a.audios[i].data - start);
+            manifest::put(f, a.audios[i].length);
+        }
+        return f;
+    }
+    // Adds a fragment saved by save_fragment to arena a as if the img at start had been parsed
+    img_span load_fragment(parser& a, std::string const& f, size_t start) const
+    {
+        auto r = manifest::reader { f.data(), f.data() + f.size() };
+        img_span s;
+        s.root = static_cast<id_t>(a.nodes.size());
+        s.string_first = static_cast<id_t>(a.strings.size());
+        s.sort_first = a.nodes_to_sort.size();
+        s.bitmap_first = a.bitmaps.size();
+        s.audio_first = a.audios.size();
+        auto node_count = r.get<uint32_t>();
+        auto string_count = r.get<uint32_t>();
+        auto sort_count = r.get<uint32_t>();
+        auto bitmap_count = r.get<uint32_t>();
+        auto audio_count = r.get<uint32_t>();
+        auto string_id = [&](id_t id) { return id == 0 ? id : id - 1 + s.string_first; };
+        a.nodes.resize(s.root + node_count);
+        for (auto i = s.root; i < a.nodes.size(); ++i) {
+            auto& n = a.nodes[i];
+            n = r.get<node>();
+            n.name = string_id(n.name);
+            n.children = n.children ? n.children + s.root : 0;
+            switch (n.data_type) {
+            case node::type::string:
+            case node::type::uol:
+                n.data.string = string_id(n.data.string);
+                break;
+            case node::type::bitmap:
+                n.data.bitmap.id = static_cast<uint32_t>(n.data.bitmap.id + s.bitmap_first);
+                break;
+            case node::type::audio:
+                n.data.audio.id = static_cast<uint32_t>(n.data.audio.id + s.audio_first);
+                break;
+            default:
+                break;
+            }
+        }
+        for (auto i = 0u; i < string_count; ++i) {
+            auto size = r.get<uint32_t>();
+            a.strings.emplace_back(r.take(size), size);
+            a.string_hashes.push_back(nx_extension::name_hash(a.strings.back().data(), size));
+        }
+        for (auto i = 0u; i < sort_count; ++i) {
+            auto first = r.get<id_t>() + s.root;
+            a.nodes_to_sort.emplace_back(first, r.get<id_t>());
+        }
+        for (auto i = 0u; i < bitmap_count; ++i) {
+            auto data = r.get<uint64_t>() + start;
+            a.bitmaps.push_back({ data, ::Key::get(r.get<::Key::IV>()).data() });
+        }
+        for (auto i = 0u; i < audio_count; ++i) {
+            auto data = r.get<uint64_t>() + start;
+            a.audios.push_back({ r.get<uint32_t>(), data });
+        }
+        s.node_end = static_cast<id_t>(a.nodes.size());
+        s.string_end = static_cast<id_t>(a.strings.size());
+        s.sort_end = a.nodes_to_sort.size();
+        s.bitmap_end = a.bitmaps.size();
+        s.audio_end = a.audios.size();
+        return s;
+    }
+    // imgs are independent of each other, so they are parsed on several threads, each into an
+    // arena of its own. The arenas are then appended in img order, giving the same nodes and
+    // strings as parsing every img in turn. Incremental conversions always go through arenas,
+    // as that is the shape fragments are saved and loaded in.
+    void parse_imgs()
+    {
+        // imgs are stored back to back right after the directories
+        std::vector<size_t> starts;
+        auto p = in.tell();
+        auto run = img_runs.begin();
+        for (auto i = size_t { 0 }; i < imgs.size(); ++i) {
+            if (run != img_runs.end() && run->first == i)
+                p = run++->second;
+            starts.push_back(p);
+            p += static_cast<size_t>(imgs[i].second);
+        }
+        // Dropped imgs only mattered for where the ones after them start
+        if (!filter.empty()) {
+            auto kept = size_t { 0 };
+            for (auto i = size_t { 0 }; i < imgs.size(); ++i)
+                if (imgs[i].first != 0) {
+                    starts[kept] = starts[i];
+                    imgs[kept++] = imgs[i];
+                }
+            imgs.resize(kept);
+            starts.resize(kept);
+        }
+        auto workers = std::min<size_t>(threads, imgs.size());
+        if (!incremental && (workers <= 1 || pool == nullptr)) {
+            for (auto i = size_t { 0 }; i < imgs.size(); ++i) {
+                // Have the next img read in while this one is parsed
+                if (i + 1 < imgs.size())
+                    in.prefetch(starts[i + 1], imgs[i + 1].second);
+                in.seek(starts[i]);
+                img(imgs[i].first, imgs[i].second);
+            }
+            return;
+        }
+        workers = std::max<size_t>(workers, 1);
+        // The last arena takes the imgs the manifest already had
+        std::vector<parser> arenas(workers + 1);
+        std::vector<img_span> spans(imgs.size());
+        std::vector<std::exception_ptr> errors(imgs.size());
+        std::vector<uint64_t> hashes(imgs.size());
+        std::vector<std::string const*> fragments(imgs.size());
+        std::atomic<size_t> next_img { 0 };
+        auto work = [&](size_t w) {
+            auto& a = arenas[w];
+            a.in = in;
+            a.u8key = u8key;
+            a.u16key = u16key;
+            a.file_start = file_start;
+            a.media = media;
+            a.nodes.clear();
+            // Keeps id 0 free so every img gets its own strings, see merge_img
+            a.add_string({});
+            for (auto i = next_img++; i < imgs.size(); i = next_img++) {
+                auto& s = spans[i];
+                s.arena = w;
+                s.root = static_cast<id_t>(a.nodes.size());
+                s.string_first = static_cast<id_t>(a.strings.size());
+                s.sort_first = a.nodes_to_sort.size();
+                s.bitmap_first = a.bitmaps.size();
+                s.audio_first = a.audios.size();
+                // Threads fault all over the file, which defeats the kernel's own readahead
+                a.in.prefetch(starts[i], imgs[i].second);
+                if (i + workers < imgs.size())
+                    a.in.prefetch(starts[i + workers], imgs[i + workers].second);
+                try {
+                    if (incremental) {
+                        hashes[i] = img_hash(a.in, starts[i], imgs[i].second);
+                        auto it = previous.imgs.find(hashes[i]);
+                        if (it != previous.imgs.end()) {
+                            fragments[i] = &it->second;
+                            continue;
+                        }
+                    }
+                    a.nodes.emplace_back();
+                    a.string_map.clear();
+                    a.in.seek(starts[i]);
+                    a.img(s.root, imgs[i].second);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                    next_img = imgs.size();
+                    return;
+                }
+                s.node_end = static_cast<id_t>(a.nodes.size());
+                s.string_end = static_cast<id_t>(a.strings.size());
+                s.sort_end = a.nodes_to_sort.size();
+                s.bitmap_end = a.bitmaps.size();
+                s.audio_end = a.audios.size();
+            }
+        };
+        if (workers <= 1 || pool == nullptr) {
+            work(0);
+        } else {
+            task_group group { *pool };
+            for (auto w = size_t { 0 }; w < workers; ++w)
+                group.run([&work, w] { work(w); });
+            group.wait();
+        }
+        // Report the same error a serial parse would have run into first
+        for (auto& e : errors)
+            if (e)
+                std::rethrow_exception(e);
+        arenas[workers].add_string({});
+        for (auto i = size_t { 0 }; i < imgs.size(); ++i) {
+            if (fragments[i]) {
+                spans[i] = load_fragment(arenas[workers], *fragments[i], starts[i]);
+                spans[i].arena = workers;
+                next.imgs[hashes[i]] = *fragments[i];
+            } else if (incremental) {
+                next.imgs[hashes[i]] = save_fragment(arenas[spans[i].arena], spans[i], starts[i]);
+            }
+            merge_img(imgs[i].first, arenas[spans[i].arena], spans[i]);
+        }
+        in.seek(p);
+    }
+    void merge_img(id_t img_node, parser& a, img_span const& s)
+    {
+        // Every string of an img was added to the arena in the order the img first used it,
+        // so adding them here in that order hands out the same ids a serial parse would
+        std::vector<id_t> ids(s.string_end - s.string_first);
+        for (auto i = s.string_first; i < s.string_end; ++i)
+            ids[i - s.string_first] = add_string(std::move(a.strings[i]), a.string_hashes[i]);
+        auto string_id = [&](id_t id) { return id == 0 ? id : ids[id - s.string_first]; };
+        auto base = static_cast<id_t>(nodes.size());
+        auto node_id = [&](id_t id) { return id > s.root ? id - s.root - 1 + base : id; };
+        auto bitmap_base = bitmaps.size();
+        auto audio_base = audios.size();
+        auto fix = [&](node& n) {
+            n.children = node_id(n.children);
+            switch (n.data_type) {
+            case node::type::string:
+            case node::type::uol:
+                n.data.string = string_id(n.data.string);
+                break;
+            case node::type::bitmap:
+                n.data.bitmap.id = static_cast<uint32_t>(n.data.bitmap.id - s.bitmap_first + bitmap_base);
+                break;
+            case node::type::audio:
+                n.data.audio.id = static_cast<uint32_t>(n.data.audio.id - s.audio_first + audio_base);
+                break;
+            default:
+                break;
+            }
+        };
+        auto& root = a.nodes[s.root];
+        fix(root);
+        auto& n = nodes[img_node];
+        n.children = root.children;
+        n.num = root.num;
+        n.data_type = root.data_type;
+        n.data = root.data;
+        nodes.append(a.nodes.begin() + s.root + 1, a.nodes.begin() + s.node_end);
+        for (auto i = base; i < nodes.size(); ++i) {
+            nodes[i].name = string_id(nodes[i].name);
+            fix(nodes[i]);
+        }
+        for (auto i = s.sort_first; i < s.sort_end; ++i)
+            nodes_to_sort.emplace_back(node_id(a.nodes_to_sort[i].first), a.nodes_to_sort[i].second);
+        bitmaps.insert(bitmaps.end(), a.bitmaps.begin() + s.bitmap_first, a.bitmaps.begin() + s.bitmap_end);
+        audios.insert(audios.end(), a.audios.begin() + s.audio_first, a.audios.begin() + s.audio_end);
+    }
+    // Takes out what the filter drops and, with drop_image_only, the imgs and directories that
+    // hold nothing but canvases and sounds. This runs before links are resolved, so nothing
+    // shares children yet. Kept siblings stay in order and next to each other, so they only
+    // need renumbering. Canvases, sounds and strings no kept node has go as well.
+    void prune_nodes()
+    {
+        *progress << "Pruning nodes.......";
+        phase ph;
+        auto const none = ~uint32_t { 0 };
+        auto is_media = [](node const& n) {
+            return n.data_type == node::type::bitmap || n.data_type == node::type::audio;
+        };
+        auto is_link = [](std::string const& s) { return s == "source" || s == "_inlink" || s == "_outlink"; };
+        // Children come after their parents until links are resolved, so this goes bottom up
+        std::vector<bool> image_only(drop_image_only ? nodes.size() : 0, false);
+        for (auto i = image_only.size(); i-- > 0;) {
+            auto& n = nodes[i];
+            auto only = n.num != 0;
+            for (auto k = 0u; only && k < n.num; ++k)
+                only = image_only[n.children + k];
+            image_only[i] = only || is_media(n);
+        }
+        // Depth is none below a node the filter keeps along with everything under it
+        struct visit {
+            id_t node;
+            uint32_t depth;
+            bool in_img;
+        };
+        std::vector<bool> kept(nodes.size(), false);
+        kept[0] = true;
+        // imgtonx parses its img right into the root
+        std::vector<visit> stack { { 0, filter.empty() ? none : 0, imgs.empty() } };
+        std::vector<std::string> path;
+        while (!stack.empty()) {
+            auto v = stack.back();
+            stack.pop_back();
+            auto n = nodes[v.node];
+            auto& name = strings[n.name];
+            // Whatever was visited since the parent is at least as deep as this
+            if (v.depth != none && v.depth != 0) {
+                path.resize(v.depth - 1);
+                path.push_back(name);
+            }
+            // Only whole imgs and directories are image only, canvases inside an img can still
+            // have something the server wants below them
+            auto in_img = v.in_img || (name.size() >= 4 && name.compare(name.size() - 4, 4, ".img") == 0);
+            for (auto i = 0u; i < n.num; ++i) {
+                auto c = n.children + i;
+                auto depth = none;
+                if (v.depth != none) {
+                    path.push_back(strings[nodes[c].name]);
+                    auto r = filter.check(path);
+                    path.pop_back();
+                    if (r == path_filter::verdict::drop)
+                        continue;
+                    if (r == path_filter::verdict::some)
+                        depth = v.depth + 1;
+                }
+                if (!in_img && !image_only.empty() && image_only[c])
+                    continue;
+                // Links only ever hand a canvas its data
+                if (!media && is_media(n) && is_link(strings[nodes[c].name]))
+                    continue;
+                kept[c] = true;
+                stack.push_back({ c, depth, in_img });
+            }
+        }
+        // What is left of canvases and sounds parsed without media is empty nodes
+        if (!media)
+            for (auto i = size_t { 0 }; i < nodes.size(); ++i)
+                if (is_media(nodes[i])) {
+                    nodes[i].data_type = node::type::none;
+                    nodes[i].data.integer = 0;
+                }
+        if (std::find(kept.begin(), kept.end(), false) == kept.end()) {
+            ph.done();
+            return;
+        }
+        // Ids start out as none for what goes and anything else for what stays
+        auto number = [&](std::vector<uint32_t>& ids) {
+            auto next = uint32_t { 0 };
+            for (auto& id : ids)
+                if (id != none)
+                    id = next++;
+            return next;
+        };
+        auto compact = [&](auto& v, std::vector<uint32_t> const& ids, uint32_t count) {
+            for (auto i = size_t { 0 }; i < ids.size(); ++i)
+                if (ids[i] != none && ids[i] != i)
+                    v[ids[i]] = std::move(v[i]);
+            v.resize(count);
+        };
+        std::vector<uint32_t> node_ids(nodes.size(), none), string_ids(strings.size(), none),
+            bitmap_ids(bitmaps.size(), none), audio_ids(audios.size(), none);
+        string_ids[0] = 0;
+        for (auto i = size_t { 0 }; i < nodes.size(); ++i) {
+            auto& n = nodes[i];
+            if (!kept[i])
+                continue;
+            node_ids[i] = string_ids[n.name] = 0;
+            if (n.data_type == node::type::string || n.data_type == node::type::uol)
+                string_ids[n.data.string] = 0;
+            else if (n.data_type == node::type::bitmap)
+                bitmap_ids[n.data.bitmap.id] = 0;
+            else if (n.data_type == node::type::audio)
+                audio_ids[n.data.audio.id] = 0;
+        }
+        auto node_count = number(node_ids);
+        auto string_count = number(string_ids);
+        compact(strings, string_ids, string_count);
+        compact(string_hashes, string_ids, string_count);
+        string_map.clear();
+        for (auto i = id_t { 1 }; i < strings.size(); ++i)
+            string_map[string_hashes[i]] = i;
+        compact(bitmaps, bitmap_ids, number(bitmap_ids));
+        compact(audios, audio_ids, number(audio_ids));
+        node_arena pruned(node_count);
+        for (auto i = size_t { 0 }; i < nodes.size(); ++i) {
+            if (!kept[i])
+                continue;
+            auto& n = pruned[node_ids[i]] = nodes[i];
+            auto first = n.children, num = 0u;
+            for (auto k = 0u; k < n.num; ++k)
+                if (kept[first + k] && num++ == 0)
+                    n.children = node_ids[first + k];
+            if (num == 0)
+                n.children = 0;
+            n.num = static_cast<uint16_t>(num);
+            n.name = string_ids[n.name];
+            if (n.data_type == node::type::string || n.data_type == node::type::uol)
+                n.data.string = string_ids[n.data.string];
+            else if (n.data_type == node::type::bitmap)
+                n.data.bitmap.id = bitmap_ids[n.data.bitmap.id];
+            else if (n.data_type == node::type::audio)
+                n.data.audio.id = audio_ids[n.data.audio.id];
+        }
+        nodes = std::move(pruned);
+        ph.done();
+    }
+    void finish_parse()
+    {
+        for (auto const& n : nodes_to_sort)
+            sort_nodes(n.first, n.second);
+        if (!filter.empty() || drop_image_only || !media)
+            prune_nodes();
+        *progress << "Parsing uol.........";
+        phase ph;
+        // uol
+        find_uols(0);
+        for (;;) {
+            auto it = std::remove_if(uols.begin(), uols.end(), [this](std::vector<id_t> const& v) {
+                return resolve_uol(v);
+            });
+            auto diff = uols.end() - it;
+            uols.erase(it, uols.end());
+            if (diff == 0)
+                break;
+        }
+        for (auto& it : uols)
+            uol_fail(it);
+        ph.done();
+        // The links below are all for canvases
+        if (!media)
+            return;
+        // source
+        *progress << "Parsing source......";
+        ph = {};
+        find_links(0, "source");
+        for (;;) {
+            auto it = std::remove_if(links.begin(), links.end(), [this](std::vector<id_t> const& v) {
+                return resolve_source(v);
+            });
+            auto diff = links.end() - it;
+            links.erase(it, links.end());
+            if (diff == 0)
+                break;
+        }
+        for (auto& it : links)
+            source_fail(it, "source");
+        links.clear();
+        ph.done();
+        //_outlink
+        *progress << "Parsing _outlink....";
+        ph = {};
+        find_links(0, "_outlink");
+        for (;;) {
+            auto it = std::remove_if(links.begin(), links.end(), [this](std::vector<id_t> const& v) {
+                return resolve_outlink(v);
+            });
+            auto diff = links.end() - it;
+            links.erase(it, links.end());
+            if (diff == 0)
+                break;
+        }
+        for (auto& it : links)
+            source_fail(it, "_outlink");
+        links.clear();
+        ph.done();
+        //_inlink
+        *progress << "Parsing _inlink.....";
+        ph = {};
+        find_links(0, "_inlink");
+        for (;;) {
+            auto it = std::remove_if(links.begin(), links.end(), [this](std::vector<id_t> const& v) {
+                return resolve_inlink(v);
+            });
+            auto diff = links.end() - it;
+            links.erase(it, links.end());
+            if (diff == 0)
+                break;
+        }
+        for (auto& it : links)
+            source_fail(it, "_inlink");
+        links.clear();
+        ph.done();
+    }
+    // Profile lines are paths like Map1/100000000.img/info from the root of the NX, optionally
+    // after how many times they were looked up. Every node on the way gets the count added.
+    std::vector<uint64_t> read_profile()
+    {
+        auto f = std::ifstream { layout_profile };
+        if (!f.is_open())
+            throw std::runtime_error("Failed to open profile " + layout_profile);
+        std::vector<uint64_t> weight(nodes.size());
+        std::string line;
+        while (std::getline(f, line)) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            auto count = uint64_t { 1 };
+            auto space = line.find(' ');
+            if (space != 0 && space != std::string::npos
+                && std::all_of(line.begin(), line.begin() + space, [](char c) { return c >= '0' && c <= '9'; })) {
+                count = std::stoull(line.substr(0, space));
+                line.erase(0, space + 1);
+            }
+            std::istringstream stream(line);
+            std::string part;
+            id_t r = 0;
+            while (std::getline(stream, part, '/')) {
+                if (part.empty())
+                    continue;
+                r = get_child_full(r, part);
+                if (r == 0)
+                    break;
+                weight[r] += count;
+            }
+        }
+        return weight;
+    }
+    // Reorders the sibling groups once links are resolved, so following a path touches fewer
+    // pages. Each group is followed by the groups below it, depth first. With a profile the
+    // groups on its paths go in front of everything else, hottest first.
+    void layout_nodes()
+    {
+        *progress << "Laying out nodes....";
+        phase ph;
+        auto const none = ~id_t { 0 };
+        std::vector<uint64_t> weight;
+        if (!layout_profile.empty())
+            weight = read_profile();
+        // New position of each node and the other way around
+        std::vector<id_t> moved(nodes.size(), none), order { 0 };
+        moved[0] = 0;
+        std::vector<id_t> stack;
+        std::vector<bool> seen;
+        auto place = [&](bool hot) {
+            seen.assign(nodes.size(), false);
+            stack.assign(1, 0);
+            while (!stack.empty()) {
+                auto p = nodes[stack.back()];
+                stack.pop_back();
+                // Resolved UOLs share their target's children, and can point back up the tree
+                if (p.num == 0)
+                    continue;
+                if (p.children >= nodes.size() || p.num > nodes.size() - p.children)
+                    return false;
+                if (seen[p.children])
+                    continue;
+                seen[p.children] = true;
+                auto first = stack.size();
+                for (auto i = p.num; i-- > 0;)
+                    if (!hot || weight[p.children + i])
+                        stack.push_back(p.children + i);
+                if (hot && stack.size() == first)
+                    continue;
+                // Popped hottest first, ties in name order
+                if (hot)
+                    std::stable_sort(stack.begin() + static_cast<ptrdiff_t>(first), stack.end(),
+                        [&](id_t a, id_t b) { return weight[a] < weight[b]; });
+                if (moved[p.children] != none)
+                    continue;
+                for (auto i = 0u; i < p.num; ++i) {
+                    if (moved[p.children + i] != none)
+                        return false;
+                    moved[p.children + i] = static_cast<id_t>(order.size());
+                    order.push_back(p.children + i);
+                }
+            }
+            return true;
+        };
+        auto placed = (weight.empty() || place(true)) && place(false);
+        // Nodes no parent reaches keep their order at the end
+        for (auto i = id_t { 1 }; placed && i < nodes.size(); ++i)
+            if (moved[i] == none) {
+                moved[i] = static_cast<id_t>(order.size());
+                order.push_back(i);
+            }
+        // Groups that overlap without starting at the same node cannot be moved apart
+        for (auto i = size_t { 0 }; placed && i < nodes.size(); ++i) {
+            auto& n = nodes[i];
+            for (auto k = 0u; k < n.num && placed; ++k)
+                placed = n.children + size_t { k } < moved.size() && moved[n.children + k] == moved[n.children] + k;
+        }
+        if (!placed) {
+            std::cerr << wzfilename << " has sibling groups that overlap, keeping the parse order" << std::endl;
+            ph.done();
+            return;
+        }
+        node_arena laid_out(nodes.size());
+        for (auto i = size_t { 0 }; i < order.size(); ++i) {
+            auto& n = laid_out[i] = nodes[order[i]];
+            if (n.num != 0)
+                n.children = moved[n.children];
+        }
+        nodes = std::move(laid_out);
+        ph.done();
+    }
+    void calculate_offsets()
+    {
+        offset = 0;
+        offset += 52;
+        offset += 0x10 - (offset & 0xf);
+        node_offset = offset;
+        offset += nodes.size() * 20;
+        offset += 0x10 - (offset & 0xf);
+        string_table_offset = offset;
+        offset += strings.size() * 8;
+        offset += 0x10 - (offset & 0xf);
+        string_offset = offset;
+        offset += std::accumulate(strings.begin(), strings.end(), 0ull,
+            [](size_t n, std::string const& s) {
+                return n + s.size() + 2 + (s.size() & 1 ? 1 : 0);
+            });
+        offset += 0x10 - (offset & 0xf);
+        audio_table_offset = offset;
+        if (client) {
+            offset += audios.size() * 8;
+            offset += 0x10 - (offset & 0xf);
+        }
+        bitmap_table_offset = offset;
+        if (client) {
+            offset += bitmaps.size() * 8;
+            offset += 0x10 - (offset & 0xf);
+        }
+        audio_offset = offset;
+        if (client) {
+            offset += std::accumulate(audios.begin(), audios.end(), 0ull,
+                [](size_t n, audio const& a) { return n + a.length; });
+            offset += 0x10 - (offset & 0xf);
+        }
+        plan_extensions();
+        bitmap_offset = offset;
+    }
+    // Lays out the optional sections after the audio, followed by their directory
+    void plan_extensions()
+    {
+        extensions.clear();
+        auto add = [this](uint32_t tag, uint32_t version, size_t size) {
+            extensions.push_back({ tag, version, offset, size });
+            offset += size;
+            offset += 0x10 - (offset & 0xf);
+        };
+        if (child_index) {
+            plan_child_index();
+            add(nx_extension::child_index, 1, 8 + child_groups.size() * 12 + size_t { child_slots } * 2);
+        }
+        if (string_hash_section)
+            add(nx_extension::string_hashes, 1, strings.size() * 8);
+        if (client && codec.type != bitmap_codec::lz4)
+            add(nx_extension::bitmap_codecs, 1, 8 + ((bitmaps.size() + 7) & ~size_t { 7 }) + codec.dictionary.size());
+        if (extensions.empty())
+            return;
+        extension_offset = offset;
+        offset += 8 + extensions.size() * sizeof(nx_extension);
+        offset += 0x10 - (offset & 0xf);
+    }
+    nx_extension const& extension(uint32_t tag) const
+    {
+        return *std::find_if(extensions.begin(), extensions.end(),
+            [tag](nx_extension const& e) { return e.tag == tag; });
+    }
+    // Tables are at most half full
+    static uint32_t child_table_size(uint16_t num)
+    {
+        auto n = 1u;
+        while (n < num * 2u)
+            n <<= 1;
+        return n;
+    }
+    void plan_child_index()
+    {
+        child_groups.clear();
+        child_slots = 0;
+        for (auto i = size_t { 0 }; i < nodes.size(); ++i) {
+            auto num = nodes[i].num;
+            if (num < child_index_min)
+                continue;
+            child_groups.emplace_back(static_cast<id_t>(i), child_slots);
+            child_slots += child_table_size(num);
+        }
+    }
+    void open_output()
+    {
+        *progress << "Opening output......";
+        phase ph;
+        calculate_offsets();
+        out.open(nxfilename, offset);
+        out.seek(0);
+        out.write<uint32_t>(client && codec.type != bitmap_codec::lz4 ? bitmap_codec::magic : 0x34474B50);
+        out.write<uint32_t>(static_cast<uint32_t>(nodes.size()));
+        out.write<uint64_t>(node_offset);
+        out.write<uint32_t>(static_cast<uint32_t>(strings.size()));
+        out.write<uint64_t>(string_table_offset);
+        if (client) {
+            out.write<uint32_t>(static_cast<uint32_t>(bitmaps.size()));
+            out.write<uint64_t>(bitmap_table_offset);
+            out.write<uint32_t>(static_cast<uint32_t>(audios.size()));
+            out.write<uint64_t>(audio_table_offset);
+        } else {
+            out.write<uint32_t>(0);
+            out.write<uint64_t>(0);
+            out.write<uint32_t>(0);
+            out.write<uint64_t>(0);
+        }
+        if (!extensions.empty()) {
+            out.write<uint32_t>(nx_extension::magic);
+            out.write<uint64_t>(extension_offset);
+            out.seek(extension_offset);
+            out.write<uint32_t>(static_cast<uint32_t>(extensions.size()));
+            out.write<uint32_t>(0);
+            for (auto& e : extensions)
+                out.write(e);
+        }
+        ph.done();
+    }
+    void write_nodes()
+    {
+        *progress << "Writing nodes.......";
+        phase ph;
+        out.seek(node_offset);
+        nodes.for_each_chunk([this](node const* data, size_t count) { out.write(data, count * 20); });
+        if (child_index)
+            write_child_index();
+        ph.done();
+    }
+    // The header is the magic, version, node and string counts, and where the record index,
+    // records and string table are. Strings are laid out as usual.
+    void write_compact()
+    {
+        *progress << "Writing nodes.......";
+        phase ph;
+        std::string records;
+        std::vector<uint64_t> index;
+        for (auto i = size_t { 0 }; i < nodes.size(); ++i) {
+            if (i % compact_record::block == 0)
+                index.push_back(records.size());
+            compact_record::encode(records, nodes[i], static_cast<uint32_t>(i));
+        }
+        offset = 40;
+        offset += 0x10 - (offset & 0xf);
+        auto index_offset = offset;
+        offset += index.size() * 8;
+        offset += 0x10 - (offset & 0xf);
+        auto records_offset = offset;
+        offset += records.size();
+        offset += 0x10 - (offset & 0xf);
+        string_table_offset = offset;
+        offset += strings.size() * 8;
+        offset += 0x10 - (offset & 0xf);
+        string_offset = offset;
+        offset += std::accumulate(strings.begin(), strings.end(), 0ull,
+            [](size_t n, std::string const& s) {
+                return n + s.size() + 2 + (s.size() & 1 ? 1 : 0);
+            });
+        out.open(nxfilename, offset);
+        out.seek(0);
+        out.write<uint32_t>(compact_record::magic);
+        out.write<uint32_t>(compact_record::version);
+        out.write<uint32_t>(static_cast<uint32_t>(nodes.size()));
+        out.write<uint32_t>(static_cast<uint32_t>(strings.size()));
+        out.write<uint64_t>(index_offset);
+        out.write<uint64_t>(records_offset);
+        out.write<uint64_t>(string_table_offset);
+        out.seek(index_offset);
+        out.write(index.data(), index.size() * 8);
+        out.seek(records_offset);
+        out.write(records.data(), records.size());
+        ph.done();
+        *progress << records.size() + index.size() * 8 << " bytes of nodes instead of " << nodes.size() * 20
+                  << std::endl;
+    }
+    // Open addressing tables over the names of each large sibling group, so readers can skip
+    // the binary search. The section starts with the number of groups and of slots, then each
+    // group as its parent, first slot and slot count. The slots are u16, holding the index of a
+    // child among its siblings plus one, or 0 when empty. Lookups start at the name hash masked
+    // by the slot count and go up by one, wrapping around, until an empty slot.
+    void write_child_index()
+    {
+        out.seek(extension(nx_extension::child_index).offset);
+        out.write<uint32_t>(static_cast<uint32_t>(child_groups.size()));
+        out.write<uint32_t>(child_slots);
+        for (auto& g : child_groups) {
+            out.write<uint32_t>(g.first);
+            out.write<uint32_t>(g.second);
+            out.write<uint32_t>(child_table_size(nodes[g.first].num));
+        }
+        std::vector<uint16_t> slots;
+        for (auto& g : child_groups) {
+            auto& parent = nodes[g.first];
+            slots.assign(child_table_size(parent.num), 0);
+            auto mask = slots.size() - 1;
+            for (auto i = 0u; i < parent.num; ++i) {
+                auto s = string_hashes[nodes[parent.children + i].name] & mask;
+                while (slots[s])
+                    s = (s + 1) & mask;
+                slots[s] = static_cast<uint16_t>(i + 1);
+            }
+            out.write(slots.data(), slots.size() * 2);
+        }
+    }
+    void write_strings()
+    {
+        *progress << "Writing strings.....";
+        phase ph;
+        out.seek(string_table_offset);
+        auto next_str = string_offset;
+        for (auto const& s : strings) {
+            out.write<uint64_t>(next_str);
+            next_str += s.size() + 2;
+            if (s.size() & 1)
+                ++next_str;
+        }
+        out.seek(string_offset);
+        for (auto const& s : strings) {
+            out.write<uint16_t>(static_cast<uint16_t>(s.size()));
+            out.write(s.data(), s.size());
+            if (s.size() & 1)
+                out.skip(1);
+        }
+        // Parallel to the string table, so readers can rule a name out without reading it
+        if (string_hash_section) {
+            out.seek(extension(nx_extension::string_hashes).offset);
+            out.write(string_hashes.data(), string_hashes.size() * 8);
+        }
+        ph.done();
+    }
+    void write_audio()
+    {
+        *progress << "Writing audio.......";
+        phase ph;
+        file.advise_random();
+        out.seek(audio_table_offset);
         auto audio_off = audio_offset;
         for (auto& a : audios) {
             out.write<uint64_t>(audio_off);
             audio_off += a.length;
         }
         out.seek(audio_offset);
-        for (auto& a : audios)
-            out.write(in.base + a.data, a.length);
-        std::cout << "Done!" << std::endl;
+        for (auto i = size_t { 0 }; i < audios.size(); ++i) {
+            if (i + 1 < audios.size())
+                in.prefetch(audios[i + 1].data, audios[i + 1].length);
+            in.seek(audios[i].data);
+            out.write(in.view(audios[i].length), audios[i].length);
+        }
+        ph.done();
+    }
+    static constexpr size_t prefetch_batch = 64;
+    // Prefetches the canvases of the batch starting at first. Their payload sizes are not known
+    // yet, so the range is padded, and spread out batches only get each canvas start.
+    void prefetch_bitmaps(size_t first)
+    {
+        static constexpr size_t slack = 0x40000, max_span = 0x4000000;
+        auto last = std::min(bitmaps.size(), first + prefetch_batch);
+        auto lo = ~size_t { 0 }, hi = size_t { 0 };
+        for (auto i = first; i < last; ++i) {
+            lo = std::min<size_t>(lo, bitmaps[i].data);
+            hi = std::max<size_t>(hi, bitmaps[i].data);
+        }
+        if (hi - lo <= max_span) {
+            in.prefetch(lo, hi - lo + slack);
+        } else {
+            for (auto i = first; i < last; ++i)
+                in.prefetch(bitmaps[i].data, slack);
+        }
+    }
+    // Decodes canvas index into 8888 pixels at the front of input, returning their size.
+    // Touches nothing shared, so canvases can be decoded on several threads at once.
+    uint32_t decode_bitmap(icursor& in, uint32_t index, std::vector<uint8_t>& input,
+        std::vector<uint8_t>& output) const
+    {
+        auto& b = bitmaps[index];
+        in.seek(b.data);
+        auto width = in.read_cint();
+        auto height = in.read_cint();
+        if (width < 0 || height < 0 || width > 0xffff || height > 0xffff
+            || int64_t { width } * height * 4 > 0x7fffffff) {
+            std::cerr << "Invalid image size: " << std::dec << width << ", " << height << std::endl;
+            throw wz_error("Invalid canvas size", b.data);
+        }
+        auto f1 = in.read_cint();
+        auto f2 = static_cast<unsigned>(in.read<uint8_t>()); // Cast away from char to preserve sanity
+        auto n1 = in.read<uint32_t>();
+        if (n1) {
+            std::cerr << "non-zero n1: "
+                      << "0x" << std::setfill('0') << std::setw(8) << std::hex << n1;
+            throw wz_error("Invalid canvas header", b.data);
+        }
+        auto length = in.read<uint32_t>();
+        auto n2 = static_cast<unsigned>(in.read<uint8_t>());
+        if (n2) {
+            std::cerr << "non-zero n2: "
+                      << " 0x" << std::setfill('0') << std::setw(2) << std::hex
+                      << n2 << std::endl;
+            throw wz_error("Invalid canvas header", b.data);
+        }
+        auto size = width * height * 4;
+        auto biggest = std::max(static_cast<uint32_t>(size), length);
+        input.resize(biggest);
+        output.resize(biggest);
+        auto original = reinterpret_cast<uint8_t const*>(in.view(length));
+        auto key = b.key;
+        auto decompressed = 0;
+        auto decompress = [&] {
+            z_stream strm = {};
+            strm.next_in = input.data();
+            strm.avail_in = length;
+            inflateInit(&strm);
+            strm.next_out = output.data();
+            strm.avail_out = static_cast<unsigned>(output.size());
+            auto err = inflate(&strm, Z_FINISH);
+            if (err != Z_BUF_ERROR) {
+                if (err != Z_DATA_ERROR) {
+                    std::cerr << "zlib error of " << std::dec << err << std::endl;
+                }
+                return false;
+            }
+            decompressed = static_cast<int>(strm.total_out);
+            inflateEnd(&strm);
+            return true;
+        };
+        auto decrypt = [&] {
+            auto p = 0u;
+            for (auto i = 0u; i + 4 <= length;) {
+                uint32_t blen;
+                std::memcpy(&blen, original + i, 4);
+                i += 4;
+                if (blen > length - i || blen > ::Key::max_length)
+                    return false;
+                for (auto j = 0u; j < blen; ++j)
+                    input[p + j] = static_cast<uint8_t>(original[i + j] ^ key[j]);
+                i += blen;
+                p += blen;
+            }
+            length = p;
+            return true;
+        };
+        std::copy(original, original + length, input.begin());
+        if (!decompress() && (!decrypt() || !decompress())) {
+            std::cerr << "Unable to inflate: 0x" << std::setfill('0') << std::setw(2)
+                      << std::hex << (unsigned)original[0] << " 0x" << std::setfill('0')
+                      << std::setw(2) << std::hex << static_cast<unsigned>(original[1])
+                      << std::endl;
+            // Just fill the image with blank data so nothing breaks
+            f1 = 2;
+            f2 = 0;
+            decompressed = size;
+            std::fill(output.begin(), output.begin() + size, '\0');
+        }
+        input.swap(output);
+        struct color4444 {
+            uint8_t b : 4;
+            uint8_t g : 4;
+            uint8_t r : 4;
+            uint8_t a : 4;
+        };
+        static_assert(sizeof(color4444) == 2, "Your bitpacking sucks");
+        struct color8888 {
+            uint8_t b;
+            uint8_t g;
+            uint8_t r;
+            uint8_t a;
+        };
+        static_assert(sizeof(color8888) == 4, "Your bitpacking sucks");
+        struct color565 {
+            uint16_t b : 5;
+            uint16_t g : 6;
+            uint16_t r : 5;
+        };
+        static_assert(sizeof(color565) == 2, "Your bitpacking sucks");
+        auto pixels4444 = reinterpret_cast<color4444*>(input.data());
+        auto pixels565 = reinterpret_cast<color565*>(input.data());
+        auto pixelsout = reinterpret_cast<color8888*>(output.data());
+        // Sanity check the sizes
+        auto check = decompressed;
+        switch (f1) {
+        case 1:
+            check *= 2;
+            break;
+        case 2:
+            break;
+        case 257:
+            check *= 2;
+            break; // Not sure if this is accurate
+        case 513:
+            check *= 2;
+            break;
+        case 1026:
+            check *= 4;
+            break;
+        case 2050:
+            check *= 4;
+            break;
+        default:
+            std::cerr << "Unknown image format1 of" << std::dec << f1 << std::endl;
+            throw wz_error("Unknown image type", b.data);
+        }
+        auto pixels = width * height;
+        switch (f2) {
+        case 0:
+            break;
+        case 4:
+            pixels /= 256;
+            break;
+        default:
+            std::cerr << "Unknown image format2 of" << std::dec << static_cast<unsigned>(f2) << std::endl;
+            throw wz_error("Unknown image type", b.data);
+        }
+        if (check != pixels * 4) {
+            std::cerr << "Size mismatch: " << std::dec << width << "," << height << "," << decompressed << "," << f1 << "," << f2 << std::endl;
+            throw wz_error("Canvas size mismatch", b.data);
+        }
+        switch (f1) {
+        case 1:
+            for (auto i = 0; i < pixels; ++i) {
+                auto p = pixels4444[i];
+                pixelsout[i] = { table4[p.b], table4[p.g], table4[p.r], table4[p.a] };
+            }
+            input.swap(output);
+            break;
+        case 2:
+            // Do nothing
+            break;
+        case 513:
+            for (auto i = 0; i < pixels; ++i) {
+                auto p = pixels565[i];
+                pixelsout[i] = { table5[p.b], table6[p.g], table5[p.r], 255 };
+            }
+            input.swap(output);
+            break;
+        case 1026:
+            squish::DecompressImage(output.data(), width, height, input.data(), squish::kDxt3);
+            input.swap(output);
+            break;
+        case 2050:
+            squish::DecompressImage(output.data(), width, height, input.data(), squish::kDxt5);
+            input.swap(output);
+            break;
+        }
+        switch (f2) {
+        case 0:
+            // Do nothing
+            break;
+        case 4:
+            std::cerr << "Format2 of 4 at " << std::dec << index << std::endl;
+            scale<16>(input, output, width, height);
+            input.swap(output);
+            break;
+        }
+        return static_cast<uint32_t>(size);
+    }
+    // Decodes canvas index and compresses it with the codec into output, returning the
+    // compressed size
+    uint32_t encode_bitmap(icursor& in, uint32_t index, std::vector<uint8_t>& input,
+        std::vector<uint8_t>& output) const
+    {
+        auto size = decode_bitmap(in, index, input, output);
+        output.resize(codec.bound(size));
+        auto final_size = codec.compress(input.data(), size, output.data(), output.size());
+        if (final_size == 0 && size != 0)
+            throw wz_error("Failed to compress canvas", bitmaps[index].data);
+        return final_size;
+    }
+    // Samples the canvases evenly for a dictionary to compress all of them with
+    void train_codec(bitmap_codec& c)
+    {
+        *progress << "Training codec......";
+        phase ph;
+        std::vector<uint8_t> samples, input, output;
+        std::vector<size_t> sizes;
+        auto step = std::max<size_t>(1, bitmaps.size() / bitmap_codec::dictionary_samples);
+        auto cursor = in;
+        for (auto i = size_t { 0 }; i < bitmaps.size(); i += step) {
+            uint32_t size;
+            try {
+                size = decode_bitmap(cursor, static_cast<uint32_t>(i), input, output);
+            } catch (wz_error const&) {
+                // Left for write_bitmaps to report
+                continue;
+            }
+            auto n = std::min<size_t>(size, bitmap_codec::sample_size);
+            samples.insert(samples.end(), input.begin(), input.begin() + static_cast<ptrdiff_t>(n));
+            sizes.push_back(n);
+        }
+        c.train(samples, sizes);
+        ph.done();
+    }
+    // Canvases with the same header, payload and key encode to the same blob, so only the first
+    // of each is kept and the nodes of the others point at it
+    void dedupe_bitmaps()
+    {
+        *progress << "Merging bitmaps.....";
+        phase ph;
+        std::vector<uint64_t> hashes(bitmaps.size());
+        auto hash_some = [&](size_t first) {
+            auto cursor = in;
+            for (auto i = first; i < std::min(bitmaps.size(), first + prefetch_batch); ++i) {
+                try {
+                    hashes[i] = bitmap_hash(cursor, static_cast<uint32_t>(i));
+                } catch (wz_error const&) {
+                    // Left for write_bitmaps to report
+                }
+            }
+        };
+        if (pool == nullptr || threads <= 1) {
+            for (auto first = size_t { 0 }; first < bitmaps.size(); first += prefetch_batch)
+                hash_some(first);
+        } else {
+            task_group group { *pool };
+            for (auto first = size_t { 0 }; first < bitmaps.size(); first += prefetch_batch)
+                group.run([&hash_some, first] { hash_some(first); });
+            group.wait();
+        }
+        std::unordered_map<uint64_t, uint32_t, identity<uint64_t>> seen;
+        std::vector<uint32_t> ids(bitmaps.size());
+        std::vector<bitmap> kept;
+        for (auto i = size_t { 0 }; i < bitmaps.size(); ++i) {
+            auto id = static_cast<uint32_t>(kept.size());
+            if (hashes[i]) {
+                auto it = seen.emplace(hashes[i], id);
+                if (!it.second) {
+                    ids[i] = it.first->second;
+                    continue;
+                }
+            }
+            ids[i] = id;
+            kept.push_back(bitmaps[i]);
+        }
+        bitmaps = std::move(kept);
+        for (auto i = size_t { 0 }; i < nodes.size(); ++i) {
+            auto& n = nodes[i];
+            if (n.data_type == node::type::bitmap)
+                n.data.bitmap.id = ids[n.data.bitmap.id];
+        }
+        ph.done();
+    }
+    // Copies the blob the last conversion encoded from the same canvas out of the old NX
+    bool reuse_bitmap(uint64_t hash, std::vector<uint8_t>& blob, uint32_t& size) const
+    {
+        auto it = previous.blobs.find(hash);
+        if (!hash || it == previous.blobs.end() || !old_nx)
+            return false;
+        auto& b = it->second;
+        if (b.offset + 4 + b.size > old_nx->file_size)
+            return false;
+        icursor c = *old_nx;
+        c.seek(b.offset);
+        if (c.read<uint32_t>() != b.size)
+            return false;
+        auto data = reinterpret_cast<uint8_t const*>(c.view(b.size));
+        if (hash64(data, b.size, hash) != b.check)
+            return false;
+        blob.assign(data, data + b.size);
+        size = b.size;
+        return true;
     }
     void write_bitmaps()
     {
-        std::cout << "Writing bitmaps.....";
+        *progress << "Writing bitmaps.....";
+        phase ph;
+        file.advise_random();
         out.seek(bitmap_table_offset);
-        std::ofstream file(nxfilename, std::ios::app | std::ios::binary);
+        // Each batch is encoded by the pool and then written out in order
+        std::vector<std::vector<uint8_t>> blobs(prefetch_batch);
+        std::vector<uint32_t> sizes(prefetch_batch);
+        std::vector<std::exception_ptr> errors(prefetch_batch);
+        std::vector<uint64_t> hashes(prefetch_batch);
         std::vector<uint8_t> input;
-        std::vector<uint8_t> output;
-        for (auto index = 0u; index < bitmaps.size(); ++index) {
-            auto& b = bitmaps[index];
-            out.write<uint64_t>(bitmap_offset);
-            in.seek(b.data);
-            auto width = in.read_cint();
-            auto height = in.read_cint();
-            if (width < 0 || height < 0) {
-                std::cerr << "Invalid image size: " << std::dec << width << ", " << height << std::endl;
-                throw std::runtime_error { "fak" };
-            }
-            auto f1 = in.read_cint();
-            auto f2 = static_cast<unsigned>(in.read<uint8_t>()); // Cast away from char to preserve sanity
-            auto n1 = in.read<uint32_t>();
-            if (n1) {
-                std::cerr << "non-zero n1: "
-                          << "0x" << std::setfill('0') << std::setw(8) << std::hex << n1;
-                throw std::runtime_error { "fak" };
-            }
-            auto length = in.read<uint32_t>();
-            auto n2 = static_cast<unsigned>(in.read<uint8_t>());
-            if (n2) {
-                std::cerr << "non-zero n2: "
-                          << " 0x" << std::setfill('0') << std::setw(2) << std::hex
-                          << n2 << std::endl;
-                throw std::runtime_error { "fak" };
-            }
-            auto size = width * height * 4;
-            auto biggest = std::max(static_cast<uint32_t>(size), length);
-            input.resize(biggest);
-            output.resize(biggest);
-            auto original = reinterpret_cast<uint8_t const*>(in.offset);
-            auto key = b.key;
-            auto decompressed = 0;
-            auto decompress = [&] {
-                z_stream strm = {};
-                strm.next_in = input.data();
-                strm.avail_in = length;
-                inflateInit(&strm);
-                strm.next_out = output.data();
-                strm.avail_out = static_cast<unsigned>(output.size());
-                auto err = inflate(&strm, Z_FINISH);
-                if (err != Z_BUF_ERROR) {
-                    if (err != Z_DATA_ERROR) {
-                        std::cerr << "zlib error of " << std::dec << err << std::endl;
+        // The codec of every bitmap, for the bitmap_codecs section
+        std::vector<uint8_t> kinds;
+        for (auto first = 0u; first < bitmaps.size(); first += prefetch_batch) {
+            prefetch_bitmaps(first);
+            auto count = std::min<size_t>(prefetch_batch, bitmaps.size() - first);
+            auto encode = [&, first](size_t i, std::vector<uint8_t>& input) {
+                auto cursor = in;
+                try {
+                    if (incremental || cache) {
+                        hashes[i] = bitmap_hash(cursor, static_cast<uint32_t>(first + i));
+                        if (incremental && reuse_bitmap(hashes[i], blobs[i], sizes[i]))
+                            return;
+                        if (cache && hashes[i] && cache->get(hashes[i], blobs[i], sizes[i]))
+                            return;
                     }
-                    return false;
-                }
-                decompressed = static_cast<int>(strm.total_out);
-                inflateEnd(&strm);
-                return true;
-            };
-            auto decrypt = [&] {
-                auto p = 0u;
-                for (auto i = 0u; i <= length - 4;) {
-                    auto blen = *reinterpret_cast<uint32_t const*>(original + i);
-                    i += 4;
-                    if (i + blen > length)
-                        return false;
-                    for (auto j = 0u; j < blen; ++j)
-                        input[p + j] = static_cast<uint8_t>(original[i + j] ^ key[j]);
-                    i += blen;
-                    p += blen;
+                    sizes[i] = encode_bitmap(cursor, static_cast<uint32_t>(first + i), input, blobs[i]);
+                    if (cache && hashes[i])
+                        cache->put(hashes[i], blobs[i].data(), sizes[i]);
+                } catch (...) {
+                    errors[i] = std::current_exception();
                 }
-                length = p;
-                return true;
             };
-            std::copy(original, original + length, input.begin());
-            if (!decompress() && (!decrypt() || !decompress())) {
-                std::cerr << "Unable to inflate: 0x" << std::setfill('0') << std::setw(2)
-                          << std::hex << (unsigned)original[0] << " 0x" << std::setfill('0')
-                          << std::setw(2) << std::hex << static_cast<unsigned>(original[1])
-                          << std::endl;
-                // Just fill the image with blank data so nothing breaks
-                f1 = 2;
-                f2 = 0;
-                decompressed = size;
-                std::fill(output.begin(), output.begin() + size, '\0');
+            if (pool == nullptr || threads <= 1) {
+                for (auto i = size_t { 0 }; i < count; ++i)
+                    encode(i, input);
+            } else {
+                task_group group { *pool };
+                for (auto i = size_t { 0 }; i < count; ++i)
+                    group.run([&encode, i] {
+                        std::vector<uint8_t> input;
+                        encode(i, input);
+                    });
+                group.wait();
             }
-            input.swap(output);
-            struct color4444 {
-                uint8_t b : 4;
-                uint8_t g : 4;
-                uint8_t r : 4;
-                uint8_t a : 4;
-            };
-            static_assert(sizeof(color4444) == 2, "Your bitpacking sucks");
-            struct color8888 {
-                uint8_t b;
-                uint8_t g;
-                uint8_t r;
-                uint8_t a;
-            };
-            static_assert(sizeof(color8888) == 4, "Your bitpacking sucks");
-            struct color565 {
-                uint16_t b : 5;
-                uint16_t g : 6;
-                uint16_t r : 5;
-            };
-            static_assert(sizeof(color565) == 2, "Your bitpacking sucks");
-            auto pixels4444 = reinterpret_cast<color4444*>(input.data());
-            auto pixels565 = reinterpret_cast<color565*>(input.data());
-            auto pixelsout = reinterpret_cast<color8888*>(output.data());
-            // Sanity check the sizes
-            auto check = decompressed;
-            switch (f1) {
-            case 1:
-                check *= 2;
-                break;
-            case 2:
-                break;
-            case 257:
-                check *= 2;
-                break; // Not sure if this is accurate
-            case 513:
-                check *= 2;
-                break;
-            case 1026:
-                check *= 4;
-                break;
-            case 2050:
-                check *= 4;
-                break;
-            default:
-                std::cerr << "Unknown image format1 of" << std::dec << f1 << std::endl;
-                throw std::runtime_error("Unknown image type!");
+            // Only now is it known how much the batch takes up, so its blobs get their disk
+            // space in one piece before they are appended
+            auto batch_size = size_t { 0 };
+            for (auto i = size_t { 0 }; i < count; ++i)
+                batch_size += errors[i] ? 0 : sizes[i] + 4;
+            out.preallocate(batch_size);
+            for (auto i = size_t { 0 }; i < count; ++i) {
+                if (errors[i])
+                    std::rethrow_exception(errors[i]);
+                if (incremental && hashes[i])
+                    next.blobs[hashes[i]] = { bitmap_offset, sizes[i], hash64(blobs[i].data(), sizes[i], hashes[i]) };
+                out.write<uint64_t>(bitmap_offset);
+                bitmap_offset += sizes[i] + 4;
+                out.append(&sizes[i], 4);
+                out.append(blobs[i].data(), sizes[i]);
+                kinds.push_back(codec.type);
             }
-            auto pixels = width * height;
-            switch (f2) {
-            case 0:
-                break;
-            case 4:
-                pixels /= 256;
-                break;
-            default:
-                std::cerr << "Unknown image format2 of" << std::dec << static_cast<unsigned>(f2) << std::endl;
-                throw std::runtime_error("Unknown image type!");
-            }
-            if (check != pixels * 4) {
-                std::cerr << "Size mismatch: " << std::dec << width << "," << height << "," << decompressed << "," << f1 << "," << f2 << std::endl;
-                throw std::runtime_error("halp!");
-            }
-            switch (f1) {
-            case 1:
-                for (auto i = 0; i < pixels; ++i) {
-                    auto p = pixels4444[i];
-                    pixelsout[i] = { table4[p.b], table4[p.g], table4[p.r], table4[p.a] };
-                }
-                input.swap(output);
-                break;
-            case 2:
-                // Do nothing
-                break;
-            case 513:
-                for (auto i = 0; i < pixels; ++i) {
-                    auto p = pixels565[i];
-                    pixelsout[i] = { table5[p.b], table6[p.g], table5[p.r], 255 };
-                }
-                input.swap(output);
-                break;
-            case 1026:
-                squish::DecompressImage(output.data(), width, height, input.data(), squish::kDxt3);
-                input.swap(output);
-                break;
-            case 2050:
-                squish::DecompressImage(output.data(), width, height, input.data(), squish::kDxt5);
-                input.swap(output);
-                break;
+        }
+        if (codec.type != bitmap_codec::lz4) {
+            out.seek(extension(nx_extension::bitmap_codecs).offset);
+            out.write<uint32_t>(static_cast<uint32_t>(bitmaps.size()));
+            out.write<uint32_t>(static_cast<uint32_t>(codec.dictionary.size()));
+            kinds.resize((kinds.size() + 7) & ~size_t { 7 });
+            if (!kinds.empty())
+                out.write(kinds.data(), kinds.size());
+            if (!codec.dictionary.empty())
+                out.write(codec.dictionary.data(), codec.dictionary.size());
+        }
+        ph.done();
+    }
+    // Compresses every canvas with each codec and decompresses it again, without writing
+    // anything. Only the time spent in the codecs counts.
+    void bench_codecs()
+    {
+        *progress << wzfilename << std::endl;
+        parse_file();
+        std::vector<bitmap_codec> codecs;
+        for (auto k : bitmap_codec::kinds)
+            for (auto high : { false, true }) {
+                if (!bitmap_codec::available(k))
+                    continue;
+                bitmap_codec c;
+                c.type = k;
+                c.high = high;
+                if (k == bitmap_codec::zstd)
+                    train_codec(c);
+                codecs.push_back(std::move(c));
             }
-            switch (f2) {
-            case 0:
-                // Do nothing
-                break;
-            case 4:
-                std::cerr << "Format2 of 4 at " << std::dec << index << std::endl;
-                scale<16>(input, output, width, height);
-                input.swap(output);
-                break;
+        *progress << "Benching codecs.....";
+        phase ph;
+        using clock = std::chrono::steady_clock;
+        std::vector<clock::duration> encode(codecs.size()), decode(codecs.size());
+        std::vector<uint64_t> packed(codecs.size());
+        auto raw = uint64_t { 0 };
+        std::vector<uint8_t> input, output, blob, back;
+        auto cursor = in;
+        for (auto i = size_t { 0 }; i < bitmaps.size(); ++i) {
+            uint32_t size;
+            try {
+                size = decode_bitmap(cursor, static_cast<uint32_t>(i), input, output);
+            } catch (wz_error const&) {
+                continue;
             }
-            output.resize(static_cast<size_t>(LZ4_compressBound(size)));
-            uint32_t final_size;
-            if (hc) {
-                final_size = static_cast<uint32_t>(
-                    LZ4_compressHC(reinterpret_cast<char const*>(input.data()),
-                        reinterpret_cast<char*>(output.data()), size));
-            } else {
-                final_size = static_cast<uint32_t>(
-                    LZ4_compress(reinterpret_cast<char const*>(input.data()),
-                        reinterpret_cast<char*>(output.data()), size));
+            raw += size;
+            back.resize(size);
+            for (auto k = size_t { 0 }; k < codecs.size(); ++k) {
+                auto& c = codecs[k];
+                blob.resize(c.bound(size));
+                auto start = clock::now();
+                auto n = c.compress(input.data(), size, blob.data(), blob.size());
+                auto middle = clock::now();
+                auto ok = c.decompress(blob.data(), n, back.data(), size);
+                auto end = clock::now();
+                if (!ok || !std::equal(back.begin(), back.end(), input.begin()))
+                    throw std::runtime_error(std::string { bitmap_codec::name(c.type) }
+                        + " failed to round trip canvas " + std::to_string(i));
+                encode[k] += middle - start;
+                decode[k] += end - middle;
+                packed[k] += n;
             }
-            bitmap_offset += final_size + 4;
-            file.write(reinterpret_cast<char const*>(&final_size), 4);
-            file.write(reinterpret_cast<char const*>(output.data()), final_size);
         }
-        std::cout << "Done!" << std::endl;
+        ph.done();
+        *progress << bitmaps.size() << " canvases, " << raw / 1024 << " KiB of pixels" << std::endl;
+        auto ms = [](clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+        for (auto k = size_t { 0 }; k < codecs.size(); ++k) {
+            auto name = std::string { bitmap_codec::name(codecs[k].type) } + (codecs[k].high ? " -h" : "");
+            *progress << std::left << std::setw(11) << name << std::fixed << std::setprecision(2)
+                      << static_cast<double>(raw) / static_cast<double>(std::max<uint64_t>(packed[k], 1))
+                      << "x, " << packed[k] / 1024 << " KiB, encode " << ms(encode[k]) << " ms, decode "
+                      << ms(decode[k]) << " ms" << std::endl;
+        }
     }
     wztonx(sys::path filename, bool client, bool hc)
         : client(client)
         , hc(hc)
     {
+        codec.high = hc;
         wzfilename = u8string(filename);
         nxfilename = u8string(filename.replace_extension(".nx"));
-        if (!std::ifstream { wzfilename }.is_open()) {
-            return;
-        }
-        std::cout << wzfilename << " -> " << nxfilename << std::endl;
     }
     void convert_file()
     {
+        // Compact files can't be read as NX files, so they don't get to look like one
+        if (compact && u8string(sys::path { nxfilename }.extension()) == ".nx")
+            nxfilename = u8string(sys::path { nxfilename }.replace_extension(".nxc"));
+        *progress << wzfilename << " -> " << nxfilename << std::endl;
+        if (incremental)
+            load_manifest();
         parse_file();
-        open_output();
-        write_nodes();
+        if (layout)
+            layout_nodes();
+        if (client && dedupe)
+            dedupe_bitmaps();
+        if (client && codec.type == bitmap_codec::zstd)
+            train_codec(codec);
+        if (compact) {
+            write_compact();
+        } else {
+            open_output();
+            write_nodes();
+        }
         write_strings();
         if (client) {
             write_audio();
             write_bitmaps();
+            if (cache)
+                cache->trim();
         }
+        *progress << "Syncing output......";
+        phase ph;
+        old_nx.reset();
+        out.commit();
+        if (incremental)
+            save_manifest();
+        ph.done();
     }
 };
 struct imgtonx : wztonx {
@@ -1299,19 +4283,1007 @@ struct imgtonx : wztonx {
     }
     void parse_file() override
     {
-        std::cout << "Parsing input.......";
-        in.open(wzfilename);
+        *progress << "Parsing input.......";
+        phase ph;
+        open_input();
+        add_string({});
+        img(0, static_cast<int32_t>(std::min<size_t>(in.size(), 0x7fffffff)));
+        ph.done();
+        finish_parse();
+    }
+};
+// The parts of an archive split into X_000.wz up to X_NNN.wz, as listed by the X.ini beside them
+std::vector<sys::path> split_parts(sys::path const& ini)
+{
+    auto f = std::ifstream { u8string(ini) };
+    auto last = -1;
+    for (std::string line; std::getline(f, line);) {
+        static std::string const key = "LastWzIndex|";
+        if (line.compare(0, key.size(), key) == 0)
+            last = std::atoi(line.c_str() + key.size());
+    }
+    if (last < 0)
+        throw std::runtime_error("No LastWzIndex in " + u8string(ini));
+    std::vector<sys::path> parts;
+    for (auto i = 0; i <= last; ++i) {
+        char suffix[16];
+        std::snprintf(suffix, sizeof(suffix), "_%03d.wz", i);
+        auto p = ini;
+        p.replace_filename(u8string(ini.stem()) + suffix);
+        parts.push_back(p);
+    }
+    return parts;
+}
+// Whether ini lists the parts of a split archive rather than being some other .ini
+bool is_split_archive(sys::path const& ini)
+{
+    auto first = ini;
+    first.replace_filename(u8string(ini.stem()) + "_000.wz");
+    return sys::exists(first);
+}
+// The X.ini a part named X_NNN.wz belongs to, or nothing when it stands on its own
+sys::path split_archive(sys::path const& part)
+{
+    static std::regex const reg { "(.+)_[0-9]{3}\\.wz" };
+    std::smatch match;
+    auto name = u8string(part.filename());
+    if (!std::regex_match(name, match, reg))
+        return {};
+    auto ini = part;
+    ini.replace_filename(match[1].str() + ".ini");
+    return sys::exists(ini) && is_split_archive(ini) ? ini : sys::path {};
+}
+// Several WZ files converted into a single NX, for archives split into parts and for putting
+// whole archives together. The files are opened one after the other as a single input. Every
+// group gets a node of its own under the root, and the top level of each file in a group goes
+// under that node. A split archive converted on its own is a single group without a name,
+// whose top level is the root. A group can also be a single standalone img.
+struct multiwztonx : wztonx {
+    struct group {
+        std::string name;
+        std::vector<sys::path> files;
+    };
+    std::vector<group> groups;
+    static bool is_img(group const& g)
+    {
+        return g.files.size() == 1 && u8string(g.files[0].extension()) == ".img";
+    }
+    multiwztonx(sys::path nx, std::string what, std::vector<group> g, bool client, bool hc)
+        : wztonx { sys::path {}, client, hc }
+        , groups(std::move(g))
+    {
+        wzfilename = std::move(what);
+        nxfilename = u8string(nx);
+    }
+    void parse_file() override
+    {
+        std::cerr << "Working on " << wzfilename << std::endl;
+        *progress << "Parsing input.......";
+        phase ph;
+        std::vector<std::string> names;
+        for (auto& g : groups)
+            for (auto& p : g.files)
+                names.push_back(u8string(p));
+        source.open(names, memory);
+        in = {};
+        in.source = &source;
+        in.file_size = in.end = source.file_size;
+        nodes.reserve(in.size() / 64);
         add_string({});
-        img(0, 0);
+        if (groups.size() == 1 && groups[0].name.empty()) {
+            parse_parts(0, 0, source.parts.size());
+        } else {
+            if (groups.size() > 0xffff)
+                throw std::runtime_error("Too many files to put into one NX");
+            auto first = reserve_children(0, static_cast<id_t>(groups.size()));
+            auto part = size_t { 0 };
+            for (auto i = size_t { 0 }; i < groups.size(); ++i) {
+                auto node = static_cast<id_t>(first + i);
+                nodes[node].name = add_string(groups[i].name);
+                if (is_img(groups[i]))
+                    add_img(node, source.parts[part]);
+                else
+                    parse_parts(node, part, part + groups[i].files.size());
+                part += groups[i].files.size();
+            }
+        }
+        parse_imgs();
+        ph.done();
         finish_parse();
     }
+    id_t reserve_children(id_t dir_node, id_t count)
+    {
+        auto first = static_cast<id_t>(nodes.size());
+        nodes[dir_node].children = first;
+        nodes[dir_node].num = static_cast<uint16_t>(count);
+        nodes.resize(first + count);
+        nodes_to_sort.emplace_back(first, count);
+        return first;
+    }
+    // Where a part's directory starts and how many entries it has
+    id_t part_header(window_source::part const& pt)
+    {
+        in.seek(pt.start);
+        auto magic = in.read<uint32_t>();
+        if (magic != 0x31474B50)
+            throw wz_error("Not a valid WZ file", pt.start);
+        in.skip(8);
+        file_start = pt.start + in.read<uint32_t>();
+        in.seek(file_start + 2);
+        auto entries = in.read_cint();
+        if (entries < 0 || entries > 0xffff)
+            throw wz_error("Invalid child count " + std::to_string(entries), file_start + 2);
+        return static_cast<id_t>(entries);
+    }
+    // Queues the standalone img in pt to be parsed into img_node along with the others
+    void add_img(id_t img_node, window_source::part const& pt)
+    {
+        auto keep = filter.empty() || filter.check({ strings[nodes[img_node].name] }) != path_filter::verdict::drop;
+        img_runs.emplace_back(imgs.size(), pt.start);
+        imgs.emplace_back(keep ? img_node : 0, static_cast<int32_t>(std::min<size_t>(pt.size, 0x7fffffff)));
+    }
+    // Reads the directories of parts [first_part, last_part) into the children of dir_node
+    void parse_parts(id_t dir_node, size_t first_part, size_t last_part)
+    {
+        id_t total = 0;
+        for (auto i = first_part; i < last_part; ++i)
+            total += part_header(source.parts[i]);
+        if (total > 0xffff)
+            throw wz_error("Too many entries at the top of the archive", source.parts[first_part].start);
+        auto first = reserve_children(dir_node, total);
+        for (auto i = first_part; i < last_part; ++i) {
+            auto& pt = source.parts[i];
+            auto entries = part_header(pt);
+            if (entries == 0)
+                continue;
+            auto outer = in.enter(pt.size - (in.tell() - pt.start));
+            in.skip(1);
+            deduce_key([&] { sample_directory(static_cast<int32_t>(entries)); });
+            in.seek(file_start + 2);
+            auto before = imgs.size();
+            directory(dir_node, first, entries);
+            if (imgs.size() > before)
+                img_runs.emplace_back(before, in.tell());
+            in.leave(outer);
+            first += entries;
+        }
+        // Parts are not expected to share a top level directory, and lookups only find one
+        std::set<std::string> seen;
+        auto& n = nodes[dir_node];
+        for (auto i = n.children; i < n.children + n.num; ++i)
+            if (!seen.insert(strings[nodes[i].name]).second)
+                std::cerr << "More than one part has " << strings[nodes[i].name] << std::endl;
+    }
+};
+#ifdef __linux__
+// Inputs watched with inotify, to convert files again as they change. Patches get copied in
+// slowly and in pieces, so a file is only handed out once it has been left alone for a while.
+struct watcher {
+    static constexpr auto settle = std::chrono::seconds { 2 };
+    struct dir {
+        sys::path path;
+        // Watched for every input in it rather than for some files named on the command line
+        bool whole;
+    };
+    int handle = -1;
+    std::unordered_map<int, dir> dirs;
+    std::set<sys::path> files;
+    std::map<sys::path, std::chrono::steady_clock::time_point> pending;
+    watcher()
+    {
+        handle = inotify_init1(IN_CLOEXEC);
+        if (handle == -1)
+            throw std::runtime_error("Failed to start watching for changes");
+    }
+    watcher(watcher const&) = delete;
+    ~watcher() { close(handle); }
+    static bool is_input(sys::path const& p)
+    {
+        auto ext = u8string(p.extension());
+        return ext == ".wz" || ext == ".img" || ext == ".ini";
+    }
+    // Paths from the command line and from events are only compared in this form, so a.wz
+    // and ./a.wz are the same file
+    static sys::path normal(sys::path const& p) { return sys::absolute(p).lexically_normal(); }
+    void add(sys::path const& given)
+    {
+        auto p = normal(given);
+        if (sys::is_directory(p)) {
+            watch(p, true);
+            for (sys::recursive_directory_iterator it { p }, end {}; it != end; ++it)
+                if (sys::is_directory(it->path()))
+                    watch(it->path(), true);
+        } else {
+            files.insert(p);
+            watch(p.parent_path(), false);
+        }
+    }
+    void watch(sys::path const& p, bool whole)
+    {
+        auto wd = inotify_add_watch(handle, u8string(p).c_str(),
+            IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE);
+        if (wd == -1) {
+            std::cerr << "Failed to watch " << u8string(p) << std::endl;
+            return;
+        }
+        auto& d = dirs[wd];
+        d.path = p;
+        d.whole = d.whole || whole;
+    }
+    void changed(dir const& d, sys::path const& p, bool is_dir)
+    {
+        if (is_dir) {
+            // Whatever was moved in with the directory is new as well
+            if (d.whole) {
+                add(p);
+                for (sys::recursive_directory_iterator it { p }, end {}; it != end; ++it)
+                    if (is_input(it->path()))
+                        pending[it->path()] = std::chrono::steady_clock::now() + settle;
+            }
+        } else if (is_input(p)) {
+            // A changed part means converting the whole archive again, also for parts added
+            // after the archive was given by its .ini
+            auto ini = split_archive(p);
+            if (d.whole || files.count(p) || (!ini.empty() && files.count(ini)))
+                pending[ini.empty() ? p : ini] = std::chrono::steady_clock::now() + settle;
+        }
+    }
+    // Blocks until some inputs have changed and settled, and returns them
+    std::vector<sys::path> wait()
+    {
+        alignas(inotify_event) char buf[0x10000];
+        for (;;) {
+            auto now = std::chrono::steady_clock::now();
+            std::vector<sys::path> ready;
+            auto timeout = -1;
+            for (auto it = pending.begin(); it != pending.end();) {
+                if (it->second <= now) {
+                    ready.push_back(it->first);
+                    it = pending.erase(it);
+                } else {
+                    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(it->second - now).count() + 1;
+                    timeout = timeout == -1 ? static_cast<int>(left) : std::min(timeout, static_cast<int>(left));
+                    ++it;
+                }
+            }
+            if (!ready.empty())
+                return ready;
+            pollfd fd { handle, POLLIN, 0 };
+            if (poll(&fd, 1, timeout) <= 0)
+                continue;
+            auto n = read(handle, buf, sizeof(buf));
+            if (n <= 0)
+                continue;
+            for (auto p = buf; p < buf + n;) {
+                auto e = reinterpret_cast<inotify_event const*>(p);
+                p += sizeof(inotify_event) + e->len;
+                auto it = dirs.find(e->wd);
+                if (it == dirs.end() || e->len == 0)
+                    continue;
+                auto d = it->second;
+                changed(d, normal(d.path / e->name), (e->mask & IN_ISDIR) != 0);
+            }
+        }
+    }
+};
+#endif
+// An NX file read in place, through the same bounds checked cursor as the input
+struct nxfile {
+    imapfile file;
+    uint32_t node_count = 0, string_count = 0, bitmap_count = 0, audio_count = 0;
+    uint64_t node_offset = 0, string_table_offset = 0, bitmap_table_offset = 0, audio_table_offset = 0;
+    std::vector<uint32_t> audio_lengths;
+    uint64_t extension_offset = 0;
+    std::vector<nx_extension> extensions;
+    // Offsets come from the file, and are checked before the cursor is pointed at them
+    void seek(uint64_t n)
+    {
+        if (n > file.size())
+            throw std::runtime_error("Offset " + std::to_string(n) + " is past the end of the file");
+        file.seek(n);
+    }
+    void open(std::string const& p)
+    {
+        file.open(p);
+        auto magic = file.size() < 52 ? 0 : file.read<uint32_t>();
+        if (magic != 0x34474B50 && magic != bitmap_codec::magic)
+            throw std::runtime_error(p + " is not an NX file");
+        node_count = file.read<uint32_t>();
+        node_offset = file.read<uint64_t>();
+        string_count = file.read<uint32_t>();
+        string_table_offset = file.read<uint64_t>();
+        bitmap_count = file.read<uint32_t>();
+        bitmap_table_offset = file.read<uint64_t>();
+        audio_count = file.read<uint32_t>();
+        audio_table_offset = file.read<uint64_t>();
+        // Files with the nodes right after the header have no room for extensions
+        if (node_offset >= 64 && file.read<uint32_t>() == nx_extension::magic) {
+            extension_offset = file.read<uint64_t>();
+            seek(extension_offset);
+            auto count = file.read<uint32_t>();
+            if (count > file.size() / sizeof(nx_extension))
+                throw std::runtime_error(p + " has a broken extension directory");
+            extensions.resize(count);
+            file.skip(4);
+            for (auto& e : extensions)
+                e = file.read<nx_extension>();
+        }
+        // Sounds are only as long as the nodes playing them say
+        audio_lengths.resize(audio_count);
+        for (auto i = 0u; audio_count != 0 && i < node_count; ++i) {
+            auto n = get_node(i);
+            if (n.data_type == node::type::audio && n.data.audio.id < audio_count)
+                audio_lengths[n.data.audio.id] = n.data.audio.length;
+        }
+    }
+    uint64_t entry(uint64_t table, uint32_t i, uint32_t count)
+    {
+        if (i >= count)
+            throw std::runtime_error("Id " + std::to_string(i) + " is past the end of its table");
+        seek(table + uint64_t { i } * 8);
+        return file.read<uint64_t>();
+    }
+    node get_node(uint32_t i)
+    {
+        seek(node_offset + uint64_t { i } * 20);
+        return file.read<node>();
+    }
+    // Strings and bitmaps come with the length in front of them, as they are stored
+    std::string_view string(uint32_t i)
+    {
+        auto p = entry(string_table_offset, i, string_count);
+        seek(p);
+        auto size = size_t { file.read<uint16_t>() } + 2;
+        seek(p);
+        return { file.view(size), size };
+    }
+    std::string_view name(uint32_t i)
+    {
+        auto s = string(i);
+        s.remove_prefix(2);
+        return s;
+    }
+    std::string_view bitmap(uint32_t i)
+    {
+        auto p = entry(bitmap_table_offset, i, bitmap_count);
+        seek(p);
+        auto size = size_t { file.read<uint32_t>() } + 4;
+        seek(p);
+        return { file.view(size), size };
+    }
+    std::string_view audio(uint32_t i)
+    {
+        seek(entry(audio_table_offset, i, audio_count));
+        return { file.view(audio_lengths[i]), audio_lengths[i] };
+    }
+};
+// Patches turning one NX into another. The strings, sounds, bitmaps and nodes of the new NX are
+// each listed in order as runs copied from the old NX or spelled out. Copied nodes get their ids
+// translated and their children moved by a fixed amount per run, so nodes are only spelled out
+// where the tree itself changed. Extension sections are carried as raw byte ranges.
+struct nxdelta {
+    static constexpr uint32_t magic = 0x3144584e; // NXD1
+    // 2 added the extension sections
+    static constexpr uint32_t version = 2;
+    // Everything up to the ops, followed by its hash
+    static constexpr size_t header_size = 116;
+    enum op : uint8_t {
+        end,
+        copy,
+        literal
+    };
+    static constexpr uint32_t none = ~uint32_t { 0 };
+    // Where each old string, sound and bitmap is in the new NX, none if nowhere
+    std::vector<uint32_t> string_map, audio_map, bitmap_map;
+    // Turns an old node into what it is in the new NX, false when it cannot be. Server NX
+    // files have no sounds or bitmaps, so their ids are left alone.
+    bool translate(node& n, int64_t delta) const
+    {
+        auto map = [](std::vector<uint32_t> const& m, uint32_t& id) {
+            if (id >= m.size() || m[id] == none)
+                return false;
+            id = m[id];
+            return true;
+        };
+        auto map_blob = [&map](std::vector<uint32_t> const& m, uint32_t& id) { return m.empty() || map(m, id); };
+        n.children = static_cast<uint32_t>(n.children + delta);
+        switch (n.data_type) {
+        case node::type::string:
+        case node::type::uol:
+            if (!map(string_map, n.data.string))
+                return false;
+            break;
+        case node::type::bitmap:
+            if (!map_blob(bitmap_map, n.data.bitmap.id))
+                return false;
+            break;
+        case node::type::audio:
+            if (!map_blob(audio_map, n.data.audio.id))
+                return false;
+            break;
+        default:
+            break;
+        }
+        return map(string_map, n.name);
+    }
+    // Same chaining as wztonx::hash_range, so a file hashes the same mapped either way
+    static uint64_t hash_file(char const* p, size_t length)
+    {
+        auto seed = uint64_t { 0 };
+        for (size_t done = 0; done < length;) {
+            auto piece = std::min<size_t>(length - done, window_source::overlap);
+            seed = hash64(p + done, piece, seed);
+            done += piece;
+        }
+        return seed;
+    }
+    template <typename T>
+    static void put(std::ostream& s, T const& v)
+    {
+        s.write(reinterpret_cast<char const*>(&v), sizeof(T));
+    }
+    template <typename T>
+    static T get(std::istream& s)
+    {
+        T v;
+        if (!s.read(reinterpret_cast<char*>(&v), sizeof(T)))
+            throw std::runtime_error("Truncated delta");
+        return v;
+    }
+    // Entries matching consecutive old ones are copied as a run, the others are spelled out.
+    // find gives the old entry to start a run at for new entry i, or none. copied is told about
+    // each run and can add to it.
+    template <typename Find, typename Same, typename Spell, typename Copied>
+    static void runs(std::ostream& s, uint32_t count, Find find, Same same, Spell spell, Copied copied)
+    {
+        std::ostringstream spelled;
+        uint32_t spelled_count = 0;
+        auto flush = [&] {
+            if (spelled_count == 0)
+                return;
+            put(s, literal);
+            put(s, spelled_count);
+            s << spelled.str();
+            spelled.str({});
+            spelled_count = 0;
+        };
+        for (auto i = 0u; i < count;) {
+            auto j = find(i);
+            if (j == none) {
+                spell(spelled, i++);
+                ++spelled_count;
+                continue;
+            }
+            flush();
+            auto n = 1u;
+            while (i + n < count && same(i + n, j + n))
+                ++n;
+            put(s, copy);
+            put(s, j);
+            put(s, n);
+            copied(s, i, j, n);
+            i += n;
+        }
+        flush();
+        put(s, end);
+    }
+    void diff(std::string const& old_path, std::string const& new_path, std::string const& delta_path)
+    {
+        *progress << old_path << " + " << new_path << " -> " << delta_path << std::endl;
+        *progress << "Diffing.............";
+        phase ph;
+        nxfile o, n;
+        o.open(old_path);
+        n.open(new_path);
+        auto s = std::ofstream { delta_path, std::ios::binary | std::ios::trunc };
+        if (!s.is_open())
+            throw std::runtime_error("Failed to create " + delta_path);
+        std::ostringstream head;
+        put(head, magic);
+        put(head, version);
+        put(head, static_cast<uint64_t>(o.file.size()));
+        put(head, wztonx::hash_range(o.file, 0, o.file.size(), 0));
+        put(head, static_cast<uint64_t>(n.file.size()));
+        put(head, wztonx::hash_range(n.file, 0, n.file.size(), 0));
+        n.file.seek(0);
+        head.write(n.file.view(52), 52);
+        // Where the data behind each table starts
+        put(head, n.string_count ? n.entry(n.string_table_offset, 0, 1) : 0);
+        put(head, n.audio_count ? n.entry(n.audio_table_offset, 0, 1) : 0);
+        put(head, n.bitmap_count ? n.entry(n.bitmap_table_offset, 0, 1) : 0);
+        // The sizes and offsets are checked before anything gets allocated from them
+        auto h = head.str();
+        s << h;
+        put(s, hash64(h.data(), h.size(), magic));
+        // Tables go first, nodes cannot be translated without them
+        auto table = [&](uint32_t old_count, uint32_t new_count, std::vector<uint32_t>& map, auto get) {
+            std::unordered_map<std::string_view, uint32_t> index;
+            for (auto i = 0u; i < old_count; ++i)
+                index.emplace(get(o, i), i);
+            map.assign(old_count, none);
+            runs(s, new_count,
+                [&](uint32_t i) {
+                    auto it = index.find(get(n, i));
+                    return it == index.end() ? none : it->second;
+                },
+                [&](uint32_t i, uint32_t j) { return j < old_count && get(n, i) == get(o, j); },
+                [&](std::ostream& out, uint32_t i) {
+                    auto v = get(n, i);
+                    put(out, static_cast<uint32_t>(v.size()));
+                    out.write(v.data(), static_cast<std::streamsize>(v.size()));
+                },
+                // The same sound or bitmap can be in there twice, the first copy is the one used
+                [&](std::ostream&, uint32_t i, uint32_t j, uint32_t count) {
+                    for (auto k = 0u; k < count; ++k)
+                        if (map[j + k] == none)
+                            map[j + k] = i + k;
+                });
+        };
+        table(o.string_count, n.string_count, string_map, [](nxfile& f, uint32_t i) { return f.string(i); });
+        table(o.audio_count, n.audio_count, audio_map, [](nxfile& f, uint32_t i) { return f.audio(i); });
+        table(o.bitmap_count, n.bitmap_count, bitmap_map, [](nxfile& f, uint32_t i) { return f.bitmap(i); });
+        // Nodes by what they hold, which leaves out ids and where their children are
+        auto key = [](nxfile& f, node const& x) {
+            auto h = static_cast<uint64_t>(x.data_type) << 16 | x.num;
+            auto name = f.string(x.name);
+            h = hash64(name.data(), name.size(), h);
+            std::string_view v;
+            switch (x.data_type) {
+            case node::type::string:
+            case node::type::uol:
+                v = f.string(x.data.string);
+                break;
+            case node::type::bitmap:
+                if (x.data.bitmap.id >= f.bitmap_count)
+                    return hash64(&x.data, 8, h);
+                v = f.bitmap(x.data.bitmap.id);
+                h ^= uint64_t { x.data.bitmap.width } << 32 | x.data.bitmap.height;
+                break;
+            case node::type::audio:
+                if (x.data.audio.id >= f.audio_count)
+                    return hash64(&x.data, 8, h);
+                v = f.audio(x.data.audio.id);
+                break;
+            default:
+                return hash64(&x.data, 8, h);
+            }
+            return hash64(v.data(), v.size(), h);
+        };
+        std::unordered_map<uint64_t, uint32_t, identity<uint64_t>> nodes_by_key;
+        for (auto i = 0u; i < o.node_count; ++i)
+            nodes_by_key.emplace(key(o, o.get_node(i)), i);
+        auto delta = int64_t { 0 };
+        auto same = [&](uint32_t i, uint32_t j) {
+            if (j >= o.node_count)
+                return false;
+            auto x = o.get_node(j);
+            auto y = n.get_node(i);
+            return translate(x, delta) && std::memcmp(&x, &y, sizeof(node)) == 0;
+        };
+        auto spelled = uint64_t { 0 };
+        runs(s, n.node_count,
+            [&](uint32_t i) {
+                auto it = nodes_by_key.find(key(n, n.get_node(i)));
+                if (it == nodes_by_key.end())
+                    return none;
+                delta = int64_t { n.get_node(i).children } - o.get_node(it->second).children;
+                return same(i, it->second) ? it->second : none;
+            },
+            same,
+            [&](std::ostream& out, uint32_t i) {
+                put(out, n.get_node(i));
+                ++spelled;
+            },
+            [&](std::ostream& out, uint32_t, uint32_t, uint32_t) { put(out, delta); });
+        // Extensions are carried as they are, along with where to find them
+        std::vector<std::pair<uint64_t, uint64_t>> raw;
+        if (!n.extensions.empty()) {
+            raw.emplace_back(52, 12);
+            raw.emplace_back(n.extension_offset, 8 + n.extensions.size() * sizeof(nx_extension));
+            for (auto& e : n.extensions)
+                raw.emplace_back(e.offset, e.size);
+        }
+        put(s, static_cast<uint32_t>(raw.size()));
+        for (auto& r : raw) {
+            put(s, r.first);
+            put(s, r.second);
+            n.seek(r.first);
+            s.write(n.file.view(r.second), static_cast<std::streamsize>(r.second));
+        }
+        if (!s.flush())
+            throw std::runtime_error("Failed to write " + delta_path);
+        ph.done();
+        *progress << n.node_count - spelled << " nodes copied, " << spelled << " spelled out" << std::endl;
+    }
+    void patch(std::string const& old_path, std::string const& delta_path, std::string const& new_path)
+    {
+        *progress << old_path << " + " << delta_path << " -> " << new_path << std::endl;
+        *progress << "Patching............";
+        phase ph;
+        nxfile o;
+        o.open(old_path);
+        auto s = std::ifstream { delta_path, std::ios::binary };
+        if (!s.is_open())
+            throw std::runtime_error("Failed to open " + delta_path);
+        auto h = std::string(header_size, '\0');
+        if (!s.read(&h[0], header_size) || get<uint64_t>(s) != hash64(h.data(), h.size(), magic))
+            throw std::runtime_error(delta_path + " is not an NX delta");
+        auto head = std::istringstream { h };
+        if (get<uint32_t>(head) != magic)
+            throw std::runtime_error(delta_path + " is not an NX delta");
+        auto v = get<uint32_t>(head);
+        if (v != version)
+            throw std::runtime_error(delta_path + " is a version " + std::to_string(v) + " delta, only version "
+                + std::to_string(version) + " can be applied");
+        auto old_size = get<uint64_t>(head);
+        auto old_hash = get<uint64_t>(head);
+        if (old_size != o.file.size() || old_hash != wztonx::hash_range(o.file, 0, o.file.size(), 0))
+            throw std::runtime_error(delta_path + " was not made from " + old_path);
+        auto new_size = get<uint64_t>(head);
+        auto new_hash = get<uint64_t>(head);
+        char header[52];
+        head.read(header, 52);
+        nxfile n;
+        std::memcpy(&n.node_count, header + 4, 4);
+        std::memcpy(&n.node_offset, header + 8, 8);
+        std::memcpy(&n.string_count, header + 16, 4);
+        std::memcpy(&n.string_table_offset, header + 20, 8);
+        std::memcpy(&n.bitmap_count, header + 28, 4);
+        std::memcpy(&n.bitmap_table_offset, header + 32, 8);
+        std::memcpy(&n.audio_count, header + 40, 4);
+        std::memcpy(&n.audio_table_offset, header + 44, 8);
+        // Everything the delta says goes somewhere has to fit in the new NX
+        auto fits = [new_size](uint64_t offset, uint64_t size) {
+            if (offset > new_size || size > new_size - offset)
+                throw std::runtime_error("Delta writes past the end of the NX");
+        };
+        fits(0, 52);
+        fits(n.node_offset, uint64_t { n.node_count } * 20);
+        fits(n.string_table_offset, uint64_t { n.string_count } * 8);
+        fits(n.audio_table_offset, uint64_t { n.audio_count } * 8);
+        fits(n.bitmap_table_offset, uint64_t { n.bitmap_count } * 8);
+        auto string_offset = get<uint64_t>(head);
+        auto audio_offset = get<uint64_t>(head);
+        auto bitmap_offset = get<uint64_t>(head);
+        omapfile out;
+        out.open(new_path, new_size);
+        out.seek(0);
+        out.write(header, 52);
+        // Each table is written along with the data behind it, strings padded to 2 bytes
+        auto table = [&](uint64_t table_offset, uint64_t data, uint32_t count, std::vector<uint32_t>& map,
+                         uint32_t old_count, auto get_old, uint64_t align) {
+            map.assign(old_count, none);
+            auto i = 0u;
+            auto add = [&](char const* p, uint64_t size) {
+                if (i >= count)
+                    throw std::runtime_error("Delta has too many entries");
+                fits(data, size);
+                out.seek(table_offset + uint64_t { i } * 8);
+                out.write<uint64_t>(data);
+                out.seek(data);
+                out.write(p, size);
+                data += size + (size & (align - 1));
+                ++i;
+            };
+            std::vector<char> buf;
+            for (auto kind = get<op>(s); kind != end; kind = get<op>(s)) {
+                if (kind != copy && kind != literal)
+                    throw std::runtime_error("Delta is corrupt");
+                auto first = kind == copy ? get<uint32_t>(s) : 0;
+                auto run = get<uint32_t>(s);
+                for (auto k = 0u; k < run; ++k) {
+                    if (kind == copy) {
+                        if (first + uint64_t { k } >= old_count)
+                            throw std::runtime_error("Delta copies past the end of " + old_path);
+                        if (map[first + k] == none)
+                            map[first + k] = i;
+                        auto v = get_old(first + k);
+                        add(v.data(), v.size());
+                        continue;
+                    }
+                    auto size = get<uint32_t>(s);
+                    fits(data, size);
+                    buf.resize(size);
+                    if (!s.read(buf.data(), static_cast<std::streamsize>(size)))
+                        throw std::runtime_error("Truncated delta");
+                    add(buf.data(), size);
+                }
+            }
+            if (i != count)
+                throw std::runtime_error("Delta has too few entries");
+        };
+        table(n.string_table_offset, string_offset, n.string_count, string_map, o.string_count,
+            [&](uint32_t i) { return o.string(i); }, 2);
+        table(n.audio_table_offset, audio_offset, n.audio_count, audio_map, o.audio_count,
+            [&](uint32_t i) { return o.audio(i); }, 1);
+        table(n.bitmap_table_offset, bitmap_offset, n.bitmap_count, bitmap_map, o.bitmap_count,
+            [&](uint32_t i) { return o.bitmap(i); }, 1);
+        out.seek(n.node_offset);
+        auto i = uint64_t { 0 };
+        for (auto kind = get<op>(s); kind != end; kind = get<op>(s)) {
+            if (kind != copy && kind != literal)
+                throw std::runtime_error("Delta is corrupt");
+            auto first = kind == copy ? get<uint32_t>(s) : 0;
+            auto run = get<uint32_t>(s);
+            auto delta = kind == copy ? get<int64_t>(s) : 0;
+            if (i + run > n.node_count)
+                throw std::runtime_error("Delta has too many nodes");
+            for (auto k = 0u; k < run; ++k) {
+                if (kind == literal) {
+                    out.write(get<node>(s));
+                    continue;
+                }
+                if (first + uint64_t { k } >= o.node_count)
+                    throw std::runtime_error("Delta copies past the end of " + old_path);
+                auto x = o.get_node(first + k);
+                if (!translate(x, delta))
+                    throw std::runtime_error("Delta copies a node that has no place in the new NX");
+                out.write(x);
+            }
+            i += run;
+        }
+        if (i != n.node_count)
+            throw std::runtime_error("Delta has too few nodes");
+        std::vector<char> buf;
+        for (auto count = get<uint32_t>(s); count; --count) {
+            auto at = get<uint64_t>(s);
+            auto size = get<uint64_t>(s);
+            fits(at, size);
+            buf.resize(size);
+            if (!s.read(buf.data(), static_cast<std::streamsize>(size)))
+                throw std::runtime_error("Truncated delta");
+            out.seek(at);
+            out.write(buf.data(), size);
+        }
+        // Nothing replaces the old output unless it is exactly what was diffed against
+        if (hash_file(out.base, new_size) != new_hash)
+            throw std::runtime_error("Patched NX does not match the one the delta was made from");
+        out.commit();
+        ph.done();
+    }
+};
+// Compact server NX files, read in place, see compact_record
+struct compact_nx {
+    imapfile file;
+    uint32_t node_count = 0, string_count = 0;
+    uint64_t index_offset = 0, records_offset = 0, string_table_offset = 0;
+    // Offsets come from the file, and are checked before the cursor is pointed at them
+    void seek(uint64_t n)
+    {
+        if (n > file.size())
+            throw std::runtime_error("Offset " + std::to_string(n) + " is past the end of the file");
+        file.seek(n);
+    }
+    void open(std::string const& p)
+    {
+        file.open(p);
+        if (file.size() < 40 || file.read<uint32_t>() != compact_record::magic
+            || file.read<uint32_t>() != compact_record::version)
+            throw std::runtime_error(p + " is not a compact NX file");
+        node_count = file.read<uint32_t>();
+        string_count = file.read<uint32_t>();
+        index_offset = file.read<uint64_t>();
+        records_offset = file.read<uint64_t>();
+        string_table_offset = file.read<uint64_t>();
+        auto blocks = (uint64_t { node_count } + compact_record::block - 1) / compact_record::block;
+        if (index_offset > file.size() || blocks > (file.size() - index_offset) / 8
+            || records_offset > string_table_offset || string_table_offset > file.size())
+            throw std::runtime_error(p + " has a broken header");
+    }
+    // Decodes forward from the start of the block the node is in
+    node get_node(uint32_t i)
+    {
+        if (i >= node_count)
+            throw std::runtime_error("Node " + std::to_string(i) + " is past the end of the file");
+        seek(index_offset + uint64_t { i / compact_record::block } * 8);
+        auto at = file.read<uint64_t>();
+        auto end = file.base + string_table_offset;
+        if (at > string_table_offset - records_offset)
+            throw std::runtime_error("Broken compact node index");
+        auto p = file.base + records_offset + at;
+        node n;
+        for (auto id = i - i % compact_record::block;; ++id) {
+            p = compact_record::decode(p, end, n, id);
+            if (id == i)
+                return n;
+        }
+    }
+    std::string_view name(uint32_t i)
+    {
+        if (i >= string_count)
+            throw std::runtime_error("Id " + std::to_string(i) + " is past the end of its table");
+        seek(string_table_offset + uint64_t { i } * 8);
+        seek(file.read<uint64_t>());
+        auto size = file.read<uint16_t>();
+        return { file.view(size), size };
+    }
+};
+// Children are sorted by name, as get_child relies on
+template <typename Reader>
+uint32_t find_child(Reader& r, node const& parent, std::string_view name)
+{
+    auto first = parent.children, count = uint32_t { parent.num };
+    while (count > 0) {
+        auto half = count / 2;
+        if (r.name(r.get_node(first + half).name) < name) {
+            first += half + 1;
+            count -= half + 1;
+        } else {
+            count = half;
+        }
+    }
+    if (first == parent.children + parent.num || r.name(r.get_node(first).name) != name)
+        return 0;
+    return first;
+}
+// Looks every node of a standard server NX up by path, in it and in its compact version, and
+// reports the time per lookup and how many pages of the file got mapped in
+struct lookup_bench {
+    static constexpr size_t max_paths = 200000;
+    static constexpr int rounds = 5;
+    std::vector<std::vector<std::string>> paths;
+    void collect(nxfile& f)
+    {
+        // Resolved UOLs share children, which are only walked the first time
+        std::vector<bool> seen(f.node_count);
+        std::vector<std::pair<uint32_t, std::vector<std::string>>> stack { { 0, {} } };
+        while (!stack.empty() && paths.size() < max_paths) {
+            auto top = std::move(stack.back());
+            stack.pop_back();
+            auto n = f.get_node(top.first);
+            if (!top.second.empty())
+                paths.push_back(top.second);
+            if (n.num == 0 || n.children >= f.node_count || seen[n.children])
+                continue;
+            seen[n.children] = true;
+            for (auto i = 0u; i < n.num; ++i) {
+                auto path = top.second;
+                path.emplace_back(f.name(f.get_node(n.children + i).name));
+                stack.emplace_back(n.children + i, std::move(path));
+            }
+        }
+        std::shuffle(paths.begin(), paths.end(), std::mt19937 { 1 });
+    }
+    template <typename Reader>
+    uint32_t lookup(Reader& r, std::vector<std::string> const& path)
+    {
+        auto id = uint32_t { 0 };
+        for (auto& part : path) {
+            id = find_child(r, r.get_node(id), part);
+            if (id == 0)
+                break;
+        }
+        return id;
+    }
+    // Resident set size in bytes, or -1 where /proc/self/statm can't tell
+    static long long resident()
+    {
+        long long size = 0, pages = -1;
+        auto statm = std::ifstream { "/proc/self/statm" };
+        if (!(statm >> size >> pages))
+            return -1;
+#ifndef _WIN32
+        return pages * sysconf(_SC_PAGESIZE);
+#else
+        return -1;
+#endif
+    }
+    // Lookups are done cold once, measuring how much of the file that brings into memory, and
+    // then timed warm
+    template <typename Reader>
+    std::vector<uint32_t> measure(char const* what, Reader& r, size_t file_size, size_t node_bytes)
+    {
+        std::vector<uint32_t> found(paths.size());
+        auto before = phase::faults();
+        auto rss_before = resident();
+        for (auto i = size_t { 0 }; i < paths.size(); ++i)
+            found[i] = lookup(r, paths[i]);
+        auto rss_after = resident();
+        auto after = phase::faults();
+        auto start = std::chrono::steady_clock::now();
+        auto sum = uint64_t { 0 };
+        for (auto round = 0; round < rounds; ++round)
+            for (auto& p : paths)
+                sum += lookup(r, p);
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        *progress << std::left << std::setw(10) << what << file_size / 1024 << " KiB, " << node_bytes / 1024
+                  << " KiB of nodes, " << ns / static_cast<long long>(rounds * std::max<size_t>(paths.size(), 1))
+                  << " ns per lookup, " << (after.first - before.first) + (after.second - before.second)
+                  << " page faults, ";
+        // Pages already in the page cache are mapped in many at a time, so the faults alone
+        // say little about how much got resident
+        if (rss_before < 0 || rss_after < 0)
+            *progress << "resident size unknown" << std::endl;
+        else
+            *progress << "resident size +" << (rss_after - rss_before) / 1024 << " KiB" << std::endl;
+        // Keeps the timed lookups from being optimized out
+        if (sum == 1)
+            *progress << std::endl;
+        return found;
+    }
+    void run(std::string const& standard_path, std::string const& compact_path)
+    {
+        *progress << standard_path << " vs " << compact_path << std::endl;
+        {
+            nxfile f;
+            f.open(standard_path);
+            collect(f);
+        }
+        *progress << paths.size() << " paths" << std::endl;
+        // Each gets its own fresh mapping, so neither benefits from the pages the other touched
+        nxfile standard;
+        standard.open(standard_path);
+        compact_nx compact;
+        compact.open(compact_path);
+        if (standard.node_count != compact.node_count)
+            throw std::runtime_error(compact_path + " is not a compact version of " + standard_path);
+        auto a = measure("standard", standard, standard.file.size(), size_t { standard.node_count } * 20);
+        auto b = measure("compact", compact, compact.file.size(),
+            compact.string_table_offset - compact.index_offset);
+        // Siblings sharing a name can only be found by the first of them, in either layout
+        *progress << std::count(a.begin(), a.end(), 0u) << " paths lead to a sibling with the same name" << std::endl;
+        if (a != b)
+            throw std::runtime_error("Lookups in " + compact_path + " disagree with " + standard_path);
+        // Only now, so the counts above are not thrown off by having read every node
+        for (auto i = 0u; i < standard.node_count; ++i) {
+            auto x = standard.get_node(i);
+            auto y = compact.get_node(i);
+            if (x.data_type == node::type::bitmap || x.data_type == node::type::audio)
+                x.data.bitmap.id = 0;
+            if (std::memcmp(&x, &y, sizeof(node)) != 0)
+                throw std::runtime_error("Node " + std::to_string(i) + " of " + compact_path + " differs");
+        }
+    }
+};
+// Converts the same input a few times with every output backend, to a scratch file next to the
+// real output. Only the output differs between the runs, so that is what the times compare.
+// Every conversion ends with an fsync, so writeback is counted as well.
+struct writer_bench {
+    static constexpr int runs = 3;
+    void run(std::function<std::unique_ptr<wztonx>()> const& make)
+    {
+        using backend = omapfile::backend;
+        for (auto kind : { backend::mmap, backend::uring, backend::direct }) {
+            char const* name = kind == backend::mmap ? "mmap" : kind == backend::uring ? "uring" : "direct";
+            std::vector<double> ms;
+            std::string failure;
+            for (auto i = 0; i < runs && failure.empty(); ++i) {
+                auto out = progress;
+                std::ostringstream log;
+                progress = &log;
+                try {
+                    auto conv = make();
+                    conv->nxfilename += ".bench";
+                    conv->out.kind = kind;
+                    auto start = std::chrono::steady_clock::now();
+                    conv->convert_file();
+                    ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+                    sys::remove(conv->nxfilename);
+                } catch (std::runtime_error const& e) {
+                    failure = e.what();
+                }
+                progress = out;
+            }
+            *progress << std::left << std::setw(8) << name;
+            if (!failure.empty()) {
+                *progress << failure << std::endl;
+                continue;
+            }
+            std::sort(ms.begin(), ms.end());
+            *progress << std::fixed << std::setprecision(0) << "best " << ms.front() << " ms, median "
+                      << ms[ms.size() / 2] << " ms, worst " << ms.back() << " ms" << std::endl;
+        }
+    }
 };
 }
+// The tests include this file for the converter alone
+#ifndef NL_NO_MAIN
 int main(int argc, char** argv)
 {
     auto old = std::cerr.rdbuf();
     auto log = std::ofstream { "NoLifeWzToNx.log" };
-    std::cerr.rdbuf(log.rdbuf());
+    nl::locked_buf log_buf { log.rdbuf() };
+    std::cerr.rdbuf(&log_buf);
     auto a = std::chrono::high_resolution_clock::now();
 #ifdef NL_NO_CODECVT
     std::setlocale(LC_ALL, "en_US.utf8");
@@ -1326,14 +5298,80 @@ Converts WZ files into NX files
         server,
         none } type { none };
     bool hc { false };
+    bool populate { false };
+    bool incremental { false };
+    bool watch { false };
+    bool child_index { false };
+    bool string_hashes { false };
+    bool layout { false };
+    std::string layout_profile;
+    bool compact { false };
+    bool server_profile { false };
+    bool drop_image_only { false };
+    bool keep_image_only { false };
+    auto codec = nl::bitmap_codec::lz4;
+    nl::path_filter filter;
+    enum { convert_inputs,
+        diff,
+        patch,
+        bench,
+        codec_bench,
+        writer_bench } mode { convert_inputs };
+    size_t memory { 0 };
+    std::string cache_dir;
+    std::string combine;
+    uint64_t cache_size { uint64_t { 4096 } << 20 };
+    auto writer = nl::omapfile::backend::mmap;
+    unsigned threads { std::max(1u, std::thread::hardware_concurrency()) };
+    unsigned batch { 1 };
     std::vector<sys::path> paths;
     std::regex reg1 { "--([a-z]+)" };
     std::regex reg2 { "-([a-z]+)" };
+    std::regex threads_reg { "--threads=([0-9]+)" };
+    std::regex iv_reg { "--iv=([0-9a-f]{8})" };
+    std::regex memory_reg { "--memory=([0-9]+)" };
+    std::regex batch_reg { "--batch=([0-9]+)" };
+    std::regex cache_reg { "--cache=(.+)" };
+    std::regex combine_reg { "--combine=(.+)" };
+    std::regex profile_reg { "--layout-profile=(.+)" };
+    std::regex include_reg { "--include=(.+)" };
+    std::regex exclude_reg { "--exclude=(.+)" };
+    std::regex cache_size_reg { "--cache-size=([0-9]+)" };
+    std::regex codec_reg { "--codec=([a-z0-9]+)" };
+    std::smatch match;
     for (auto& arg : args) {
         if (arg[0] != '-') {
             paths.emplace_back(arg);
             continue;
         }
+        // Paths keep their case
+        if (std::regex_match(arg, match, cache_reg)) {
+            cache_dir = match[1];
+            continue;
+        }
+        if (std::regex_match(arg, match, combine_reg)) {
+            combine = match[1];
+            continue;
+        }
+        if (std::regex_match(arg, match, profile_reg)) {
+            layout_profile = match[1];
+            layout = true;
+            continue;
+        }
+        if (std::regex_match(arg, match, include_reg)) {
+            if (!filter.add(filter.include, match[1])) {
+                std::cout << arg << " has no path in it" << std::endl;
+                return 1;
+            }
+            continue;
+        }
+        if (std::regex_match(arg, match, exclude_reg)) {
+            if (!filter.add(filter.exclude, match[1])) {
+                std::cout << arg << " has no path in it" << std::endl;
+                return 1;
+            }
+            continue;
+        }
         for (auto& c : arg) {
             c = std::tolower(c, std::locale::classic());
         }
@@ -1343,27 +5381,331 @@ Converts WZ files into NX files
             type = server;
         } else if (arg == "--lz4hc" || arg == "-h") {
             hc = true;
+        } else if (arg == "--populate") {
+            populate = true;
+        } else if (arg == "--incremental") {
+            incremental = true;
+        } else if (arg == "--watch") {
+            watch = true;
+        } else if (arg == "--child-index") {
+            child_index = true;
+        } else if (arg == "--compact") {
+            compact = true;
+        } else if (arg == "--server-profile") {
+            server_profile = true;
+        } else if (arg == "--drop-image-only") {
+            drop_image_only = true;
+        } else if (arg == "--keep-image-only") {
+            keep_image_only = true;
+        } else if (arg == "--bench") {
+            mode = bench;
+        } else if (arg == "--codec-bench") {
+            mode = codec_bench;
+        } else if (arg == "--writer-bench") {
+            mode = writer_bench;
+        } else if (arg == "--layout") {
+            layout = true;
+        } else if (arg == "--string-hashes") {
+            string_hashes = true;
+        } else if (arg == "--diff") {
+            mode = diff;
+        } else if (arg == "--patch") {
+            mode = patch;
+        } else if (arg == "--writer=mmap") {
+            writer = nl::omapfile::backend::mmap;
+        } else if (arg == "--writer=uring") {
+            writer = nl::omapfile::backend::uring;
+        } else if (arg == "--writer=direct") {
+            writer = nl::omapfile::backend::direct;
+        } else if (std::regex_match(arg, match, threads_reg)) {
+            threads = static_cast<unsigned>(std::max(1ul, std::stoul(match[1])));
+        } else if (std::regex_match(arg, match, batch_reg)) {
+            batch = static_cast<unsigned>(std::max(1ul, std::stoul(match[1])));
+        } else if (std::regex_match(arg, match, codec_reg)) {
+            auto k = std::find_if(std::begin(nl::bitmap_codec::kinds), std::end(nl::bitmap_codec::kinds),
+                [&](nl::bitmap_codec::kind k) { return match[1] == nl::bitmap_codec::name(k); });
+            if (k == std::end(nl::bitmap_codec::kinds) || !nl::bitmap_codec::available(*k)) {
+                std::cout << "Unknown codec " << match[1] << ", zstd needs a build with NL_ZSTD" << std::endl;
+                return 1;
+            }
+            codec = *k;
+        } else if (std::regex_match(arg, match, cache_size_reg)) {
+            // In MiB
+            cache_size = uint64_t { std::stoul(match[1]) } << 20;
+        } else if (std::regex_match(arg, match, memory_reg)) {
+            // In MiB, small budgets still get a couple of windows. Covers the input only.
+            memory = std::max<size_t>(std::stoul(match[1]), 16) << 20;
+        } else if (std::regex_match(arg, match, iv_reg)) {
+            auto v = std::stoul(match[1], nullptr, 16);
+            ::Key::IV iv { static_cast<uint8_t>(v >> 24), static_cast<uint8_t>(v >> 16),
+                static_cast<uint8_t>(v >> 8), static_cast<uint8_t>(v) };
+            nl::keys.push_back(&::Key::get(iv));
         }
     }
-    auto convert = [&](sys::path const& p) {
+    // The one thread budget covers every file, however many are converted at once
+    nl::task_pool pool { threads };
+    std::unique_ptr<nl::blob_cache> cache;
+    if (!cache_dir.empty() && type == client)
+        cache = std::make_unique<nl::blob_cache>(cache_dir, cache_size);
+    // What every conversion takes from the options
+    auto configure = [&](nl::wztonx& w) {
+        w.threads = threads;
+        w.pool = &pool;
+        w.memory = memory;
+        w.incremental = incremental;
+        w.cache = cache.get();
+        w.out.kind = writer;
+        w.child_index = child_index;
+        w.string_hash_section = string_hashes;
+        w.layout = layout;
+        w.layout_profile = layout_profile;
+        w.compact = compact;
+        w.filter = filter;
+        w.media = !server_profile;
+        w.drop_image_only = drop_image_only;
+        w.codec.type = codec;
+    };
+    auto convert_one = [&](sys::path const& p) {
         if (u8string(p.extension()) == ".img") {
-            nl::imgtonx { p, type == client, hc }.convert_file();
+            nl::imgtonx img { p, type == client, hc };
+            configure(img);
+            img.populate = populate;
+            img.convert_file();
+        } else if (u8string(p.extension()) == ".ini" && nl::is_split_archive(p)) {
+            auto nx = p;
+            nx.replace_extension(".nx");
+            nl::multiwztonx wz { nx, u8string(p), { { {}, nl::split_parts(p) } }, type == client, hc };
+            configure(wz);
+            wz.convert_file();
         } else if (u8string(p.extension()) == ".wz") {
-            nl::wztonx { p, type == client, hc }.convert_file();
+            nl::wztonx wz { p, type == client, hc };
+            configure(wz);
+            wz.populate = populate;
+            wz.convert_file();
+        } else {
+            throw std::runtime_error("Neither a .wz or .img file nor the .ini of a split archive");
         }
     };
-    for (auto& p : paths) {
-        if (sys::is_regular_file(p)) {
-            convert(p);
-        } else if (sys::is_directory(p)) {
-            for (sys::recursive_directory_iterator it { p }, end {}; it != end; ++it) {
-                convert(*it);
+    // A broken file is reported and skipped, the others still get converted
+    std::atomic<bool> failed { false };
+    auto attempt = [&](std::string const& what, std::function<void()> f) {
+        try {
+            f();
+        } catch (nl::wz_error const& e) {
+            *nl::progress << "Failed!" << std::endl;
+            std::cerr << what << " is malformed: " << e.what() << std::endl;
+            failed = true;
+        } catch (std::runtime_error const& e) {
+            *nl::progress << "Failed!" << std::endl;
+            std::cerr << what << ": " << e.what() << std::endl;
+            failed = true;
+        }
+    };
+    auto convert = [&](sys::path const& p) { attempt(u8string(p), [&] { convert_one(p); }); };
+    // Every input goes under a node named after it, with one string table and bitmap table.
+    // Archives are named after their stem, like Map, and imgs keep their .img, as they do in a
+    // directory.
+    auto convert_combined = [&](std::vector<sys::path> const& inputs) {
+        attempt(combine, [&] {
+            std::vector<nl::multiwztonx::group> groups;
+            std::map<std::string, sys::path> names;
+            std::string what;
+            for (auto& p : inputs) {
+                auto ext = u8string(p.extension());
+                auto name = u8string(ext == ".img" ? p.filename() : p.stem());
+                if (ext == ".wz" || ext == ".img")
+                    groups.push_back({ name, { p } });
+                else if (ext == ".ini" && nl::is_split_archive(p))
+                    groups.push_back({ name, nl::split_parts(p) });
+                else
+                    throw std::runtime_error(u8string(p) + " is neither a .wz or .img file nor the .ini of a split archive");
+                // Lookups would only ever find one of them
+                auto taken = names.emplace(name, p);
+                if (!taken.second)
+                    throw std::runtime_error(u8string(taken.first->second) + " and " + u8string(p)
+                        + " would both be " + name + " in " + combine);
+                what += (what.empty() ? "" : ", ") + u8string(p);
+            }
+            nl::multiwztonx wz { combine, what, std::move(groups), type == client, hc };
+            configure(wz);
+            wz.dedupe = true;
+            wz.convert_file();
+        });
+    };
+    if ((server_profile || drop_image_only) && type != server) {
+        std::cout << "--server-profile and --drop-image-only only apply to server NX files" << std::endl;
+        return 1;
+    }
+    if (keep_image_only && (!server_profile || drop_image_only)) {
+        std::cout << "--keep-image-only only applies to --server-profile, without --drop-image-only" << std::endl;
+        return 1;
+    }
+    // Most of what the profile saves is in the backgrounds and effects, which are nothing but
+    // canvases
+    if (server_profile && !keep_image_only)
+        drop_image_only = true;
+    if (compact && (type != server || child_index || string_hashes)) {
+        std::cout << "--compact only applies to server NX files, without --child-index or --string-hashes" << std::endl;
+        return 1;
+    }
+    if (mode == codec_bench) {
+        for (auto& p : paths)
+            attempt(u8string(p), [&] {
+                auto bench = [&](nl::wztonx& wz) {
+                    wz.threads = threads;
+                    wz.pool = &pool;
+                    wz.memory = memory;
+                    wz.bench_codecs();
+                };
+                auto ext = u8string(p.extension());
+                if (ext == ".img") {
+                    nl::imgtonx img { p, true, hc };
+                    bench(img);
+                } else if (ext == ".ini" && nl::is_split_archive(p)) {
+                    nl::multiwztonx wz { sys::path {}, u8string(p), { { {}, nl::split_parts(p) } }, true, hc };
+                    bench(wz);
+                } else if (ext == ".wz") {
+                    nl::wztonx wz { p, true, hc };
+                    bench(wz);
+                } else {
+                    throw std::runtime_error("Neither a .wz or .img file nor the .ini of a split archive");
+                }
+            });
+        std::cerr.rdbuf(old);
+        return failed ? 1 : 0;
+    }
+    if (mode == writer_bench) {
+        for (auto& p : paths)
+            attempt(u8string(p), [&] {
+                if (u8string(p.extension()) != ".wz")
+                    throw std::runtime_error("--writer-bench only takes .wz files");
+                *nl::progress << u8string(p) << std::endl;
+                nl::writer_bench {}.run([&] {
+                    auto wz = std::make_unique<nl::wztonx>(p, type != server, hc);
+                    wz->threads = threads;
+                    wz->pool = &pool;
+                    wz->memory = memory;
+                    wz->codec.type = codec;
+                    return wz;
+                });
+            });
+        std::cerr.rdbuf(old);
+        return failed ? 1 : 0;
+    }
+    if (mode == bench) {
+        if (paths.size() != 2) {
+            std::cout << "--bench takes STANDARD.nx COMPACT.nxc, both converted with -s" << std::endl;
+            return 1;
+        }
+        attempt(u8string(paths[1]), [&] { nl::lookup_bench {}.run(u8string(paths[0]), u8string(paths[1])); });
+        std::cerr.rdbuf(old);
+        return failed ? 1 : 0;
+    }
+    // Deltas take old.nx new.nx out.nxd, and patches old.nx delta.nxd new.nx
+    if (mode != convert_inputs) {
+        if (paths.size() != 3) {
+            std::cout << (mode == diff ? "--diff takes OLD.nx NEW.nx DELTA" : "--patch takes OLD.nx DELTA NEW.nx")
+                      << std::endl;
+            return 1;
+        }
+        auto what = u8string(paths[mode == diff ? 1 : 2]);
+        attempt(what, [&] {
+            nl::nxdelta d;
+            if (mode == diff)
+                d.diff(u8string(paths[0]), u8string(paths[1]), u8string(paths[2]));
+            else
+                d.patch(u8string(paths[0]), u8string(paths[1]), u8string(paths[2]));
+        });
+        std::cerr.rdbuf(old);
+        return failed ? 1 : 0;
+    }
+#ifdef __linux__
+    // Watching starts before the first pass, so nothing written during it gets missed
+    std::unique_ptr<nl::watcher> watcher;
+    if (watch) {
+        watcher = std::make_unique<nl::watcher>();
+        for (auto& p : paths)
+            if (sys::exists(p))
+                watcher->add(p);
+        incremental = true;
+    }
+#else
+    if (watch) {
+        std::cout << "--watch needs inotify, which only Linux has" << std::endl;
+        return 1;
+    }
+#endif
+    // Done again for every change in watch mode, which can bring new inputs along
+    auto collect = [&] {
+        std::vector<sys::path> files;
+        for (auto& p : paths) {
+            if (sys::is_regular_file(p) || sys::is_fifo(p)) {
+                files.push_back(p);
+            } else if (sys::is_directory(p)) {
+                // Parts of a split archive are converted together through its .ini, and whatever
+                // else is in there is left alone
+                for (sys::recursive_directory_iterator it { p }, end {}; it != end; ++it) {
+                    auto ext = u8string(it->path().extension());
+                    auto input = ext == ".wz" || ext == ".img" || (ext == ".ini" && nl::is_split_archive(*it));
+                    if (input && nl::split_archive(it->path()).empty())
+                        files.push_back(*it);
+                }
             }
         }
+        // Directory walks come in no particular order, which would change combined output
+        if (!combine.empty())
+            std::sort(files.begin(), files.end());
+        return files;
+    };
+    auto files = collect();
+    if (!combine.empty()) {
+        convert_combined(files);
+    } else if (batch <= 1) {
+        for (auto& p : files)
+            convert(p);
+    } else {
+        // Biggest files first, so the small ones fill in the gaps at the end
+        auto size = [](sys::path const& p) {
+            return sys::is_regular_file(p) ? static_cast<uintmax_t>(sys::file_size(p)) : 0;
+        };
+        std::stable_sort(files.begin(), files.end(),
+            [&](sys::path const& l, sys::path const& r) { return size(l) > size(r); });
+        // Each lane converts one file at a time, while the pool spreads their imgs and bitmaps
+        std::atomic<size_t> next { 0 };
+        std::mutex print;
+        nl::task_group lanes { pool };
+        for (auto i = size_t { 0 }; i < std::min<size_t>(batch, files.size()); ++i)
+            lanes.run(
+                [&] {
+                    for (auto f = next++; f < files.size(); f = next++) {
+                        std::ostringstream log;
+                        nl::progress = &log;
+                        convert(files[f]);
+                        nl::progress = &std::cout;
+                        std::lock_guard<std::mutex> lock { print };
+                        std::cout << log.str() << std::flush;
+                    }
+                },
+                true);
+        lanes.wait(true);
+    }
+#ifdef __linux__
+    // Runs until killed, with the keys, pool and cache staying warm between changes
+    while (watcher) {
+        std::cout << "Watching for changes..." << std::endl;
+        auto changed = watcher->wait();
+        if (!combine.empty())
+            convert_combined(collect());
+        else
+            for (auto& p : changed)
+                convert(p);
     }
+#endif
     auto b = std::chrono::high_resolution_clock::now();
     std::cout << "Took " << std::dec
               << std::chrono::duration_cast<std::chrono::seconds>(b - a).count() << " seconds"
               << std::endl;
     std::cerr.rdbuf(old);
+    return failed ? 1 : 0;
 }
+#endif
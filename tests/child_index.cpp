@@ -0,0 +1,86 @@
+// Every child of a node with a child index has to be found by probing the slots from the hash of
+// its name, the way a reader of the CHIX section would.
+#include "test.h"
+
+template <typename T>
+T get(std::string const& s, size_t offset)
+{
+    T v {};
+    if (offset + sizeof(T) <= s.size())
+        std::memcpy(&v, s.data() + offset, sizeof(T));
+    return v;
+}
+
+int main()
+{
+    test::scratch dir { "child_index" };
+    auto gms = &::Key::get(::Key::gms_iv);
+    auto children = [&](int count) {
+        std::vector<test::prop> p;
+        for (auto i = 0; i < count; ++i)
+            p.emplace_back("c" + std::to_string(i * 7919 % 1000), test::integer(i));
+        return p;
+    };
+    auto big = children(100);
+    big.emplace_back("nested", test::sub(gms, children(40)));
+    auto wz = test::wz(gms,
+        { { "Big.img", test::img(gms, big) }, { "Small.img", test::img(gms, children(5)) },
+            { "Edge.img", test::img(gms, children(static_cast<int>(nl::wztonx::child_index_min))) } });
+    test::write_file(dir / "Data.wz", wz);
+    std::ostringstream quiet;
+    nl::progress = &quiet;
+    try {
+        nl::wztonx conv { dir / "Data.wz", false, false };
+        conv.child_index = true;
+        conv.convert_file();
+    } catch (std::exception const& e) {
+        test::check(false, std::string { "converting: " } + e.what());
+        return test::result();
+    }
+    auto file = test::read_file(dir / "Data.nx");
+    nl::nxfile nx;
+    nx.open(dir / "Data.nx");
+    // The directory is found through the padding after the header
+    test::check(get<uint32_t>(file, 52) == nl::nx_extension::magic, "extension directory");
+    auto directory = get<uint64_t>(file, 56);
+    auto section = nl::nx_extension {};
+    for (auto i = 0u; i < get<uint32_t>(file, directory); ++i) {
+        auto e = get<nl::nx_extension>(file, directory + 8 + i * sizeof(nl::nx_extension));
+        if (e.tag == nl::nx_extension::child_index)
+            section = e;
+    }
+    test::check(section.tag == nl::nx_extension::child_index && section.offset + section.size <= file.size(),
+        "child index section");
+    auto groups = get<uint32_t>(file, section.offset);
+    auto total = get<uint32_t>(file, section.offset + 4);
+    auto slots = section.offset + 8 + uint64_t { groups } * 12;
+    test::check(8 + uint64_t { groups } * 12 + uint64_t { total } * 2 == section.size, "section size");
+    std::set<uint32_t> indexed;
+    for (auto g = 0u; g < groups; ++g) {
+        auto id = get<uint32_t>(file, section.offset + 8 + g * 12);
+        auto first = get<uint32_t>(file, section.offset + 8 + g * 12 + 4);
+        auto size = get<uint32_t>(file, section.offset + 8 + g * 12 + 8);
+        indexed.insert(id);
+        auto parent = nx.get_node(id);
+        test::check(size >= parent.num && (size & (size - 1)) == 0 && first + size <= total,
+            "table of node " + std::to_string(id) + " is a power of two that fits its children");
+        for (auto i = 0u; i < parent.num; ++i) {
+            auto name = nx.name(nx.get_node(parent.children + i).name);
+            auto s = nl::nx_extension::name_hash(name.data(), name.size()) & (size - 1);
+            auto probes = 0u;
+            for (; probes < size; ++probes, s = (s + 1) & (size - 1)) {
+                auto slot = get<uint16_t>(file, slots + (first + s) * 2);
+                if (slot == 0 || slot == i + 1)
+                    break;
+            }
+            test::check(probes < size && get<uint16_t>(file, slots + (first + s) * 2) == i + 1,
+                "child " + std::string { name } + " of node " + std::to_string(id) + " found through the slots");
+        }
+    }
+    // Exactly the nodes with enough children get a table
+    for (auto i = 0u; i < nx.node_count; ++i)
+        test::check((nx.get_node(i).num >= nl::wztonx::child_index_min) == (indexed.count(i) != 0),
+            "node " + std::to_string(i) + " is indexed when it has enough children");
+    test::check(indexed.size() == 3, "three nodes indexed");
+    return test::result();
+}
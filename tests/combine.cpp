@@ -0,0 +1,46 @@
+// Every input of --combine gets a node named after it under the root, also when there is only
+// the one, and standalone imgs go in next to the archives.
+#include "test.h"
+
+int main()
+{
+    test::scratch dir { "combine" };
+    auto gms = &::Key::get(::Key::gms_iv);
+    test::write_file(dir / "Map.wz", test::wz(gms, { { "info", test::img(gms, { { "name", 1 } }) } }));
+    test::write_file(dir / "Alone.img", test::img(gms, { { "info", 2 }, { "name", 3 } }));
+    std::ostringstream quiet;
+    nl::progress = &quiet;
+    // The names of the children of path in the combined NX
+    auto children = [&](std::vector<nl::multiwztonx::group> groups, std::vector<std::string> const& path) {
+        std::vector<std::string> names;
+        try {
+            nl::multiwztonx conv { dir / "Combined.nx", "test", std::move(groups), false, false };
+            conv.convert_file();
+            nl::nxfile f;
+            f.open(dir / "Combined.nx");
+            auto n = f.get_node(0);
+            for (auto& part : path)
+                for (auto i = 0u; i < n.num; ++i)
+                    if (f.name(f.get_node(n.children + i).name) == part) {
+                        n = f.get_node(n.children + i);
+                        break;
+                    }
+            for (auto i = 0u; i < n.num; ++i)
+                names.emplace_back(f.name(f.get_node(n.children + i).name));
+        } catch (std::exception const& e) {
+            test::check(false, std::string { "converting: " } + e.what());
+        }
+        return names;
+    };
+    using names = std::vector<std::string>;
+    test::check(children({ { "Map", { dir / "Map.wz" } } }, {}) == names { "Map" }, "a single archive has a node");
+    test::check(children({ { "Map", { dir / "Map.wz" } } }, { "Map" }) == names { "info" },
+        "the archive's top level is under its node");
+    test::check(children({ { "Alone.img", { dir / "Alone.img" } }, { "Map", { dir / "Map.wz" } } }, {})
+            == names { "Alone.img", "Map" },
+        "imgs go next to archives");
+    test::check(children({ { "Alone.img", { dir / "Alone.img" } }, { "Map", { dir / "Map.wz" } } }, { "Alone.img" })
+            == names { "info", "name" },
+        "the img is parsed");
+    return test::result();
+}
@@ -0,0 +1,67 @@
+// Every node read back from a compact server NX has to be the node the standard server NX has
+// in its place, and lookups by name have to find the same nodes in both.
+#include "test.h"
+
+int main()
+{
+    test::scratch dir { "compact" };
+    auto gms = &::Key::get(::Key::gms_iv);
+    std::vector<test::prop> mob { { "hp", test::integer(100) }, { "speed", test::integer(-20) },
+        { "exp", test::wide(int64_t { 1 } << 40) }, { "debt", test::wide(-(int64_t { 1 } << 35)) },
+        { "level", test::wide(-3) }, { "name", test::text(gms, "Orange Mushroom") },
+        { "lt", test::vector(gms, -25, -50) }, { "rb", test::vector(gms, 1 << 20, 0) },
+        { "link", test::uol(gms, "../name") } };
+    // Enough children that they span several blocks of the record index
+    std::vector<test::prop> many;
+    for (auto i = 0; i < 30; ++i)
+        many.emplace_back(std::to_string(i), test::integer(i * 1000 - 15000));
+    mob.emplace_back("skills", test::sub(gms, many));
+    mob.emplace_back("empty", test::sub(gms, {}));
+    auto wz = test::wz(gms,
+        { { "Mob.img", test::img(gms, mob) },
+            { "Map.img", test::img(gms, { { "info", test::sub(gms, { { "town", test::integer(1) } }) } }) } });
+    test::write_file(dir / "Data.wz", wz);
+    std::ostringstream quiet;
+    nl::progress = &quiet;
+    try {
+        for (auto compact : { false, true }) {
+            nl::wztonx conv { dir / "Data.wz", false, false };
+            conv.compact = compact;
+            conv.convert_file();
+        }
+    } catch (std::exception const& e) {
+        test::check(false, std::string { "converting: " } + e.what());
+        return test::result();
+    }
+    nl::nxfile standard;
+    standard.open(dir / "Data.nx");
+    nl::compact_nx compact;
+    compact.open(dir / "Data.nxc");
+    test::check(compact.node_count == standard.node_count, "same node count");
+    test::check(standard.node_count > 3 * nl::compact_record::block, "several blocks of nodes");
+    auto kinds = std::set<nl::node::type> {};
+    auto integers = std::set<int64_t> {};
+    for (auto i = 0u; i < standard.node_count && i < compact.node_count; ++i) {
+        auto x = standard.get_node(i);
+        auto y = compact.get_node(i);
+        kinds.insert(x.data_type);
+        if (x.data_type == nl::node::type::integer)
+            integers.insert(x.data.integer);
+        test::check(std::memcmp(&x, &y, sizeof(nl::node)) == 0, "node " + std::to_string(i) + " is the same");
+        test::check(standard.name(x.name) == compact.name(y.name), "node " + std::to_string(i) + " has the same name");
+        for (auto k = 0u; k < x.num; ++k) {
+            auto name = standard.name(standard.get_node(x.children + k).name);
+            auto a = nl::find_child(standard, x, name);
+            auto b = nl::find_child(compact, y, name);
+            test::check(a == x.children + k && b == a,
+                "child " + std::string { name } + " of node " + std::to_string(i) + " is found in both");
+        }
+        test::check(nl::find_child(standard, x, "missing") == 0 && nl::find_child(compact, y, "missing") == 0,
+            "nothing found under node " + std::to_string(i) + " by a name it doesn't have");
+    }
+    for (auto t : { nl::node::type::none, nl::node::type::integer, nl::node::type::string, nl::node::type::vector })
+        test::check(kinds.count(t) != 0, "nodes of type " + std::to_string(static_cast<int>(t)));
+    for (auto v : { int64_t { 1 } << 40, -(int64_t { 1 } << 35), int64_t { -3 }, int64_t { -15000 } })
+        test::check(integers.count(v) != 0, "integer " + std::to_string(v));
+    return test::result();
+}
@@ -0,0 +1,40 @@
+// Which key an img is decrypted with must not depend on which imgs the same thread parsed
+// before it, or the output would change with the number of threads.
+#include "test.h"
+
+int main()
+{
+    test::scratch dir { "deduce_key" };
+    auto gms = &::Key::get(::Key::gms_iv);
+    // "Property" encrypted with either of gms and this key reads as text with the other one
+    auto other = &::Key::get({ 0x10, 0x00, 0x00, 0xB7 });
+    nl::keys.push_back(other);
+    // Only gms fits the names of the first img, while both fit the names of the second img,
+    // which ties go to the later key for. Parsed after the first img, the second one used to
+    // be read with gms.
+    auto wz = test::wz(gms,
+        { { "info", test::img(gms, { { "info", 1 }, { "name", 2 } }) },
+            { "name", test::img(other, { { "Max", 3 } }) },
+            { "info", test::img(gms, { { "name", 4 } }) },
+            { "name", test::img(other, { { "Max", 5 } }) } });
+    test::write_file(dir / "Ambiguous.wz", wz);
+    std::ostringstream quiet;
+    nl::progress = &quiet;
+    std::vector<std::string> outputs;
+    for (auto threads : { 1u, 4u }) {
+        nl::task_pool pool { threads };
+        try {
+            nl::wztonx conv { dir / "Ambiguous.wz", false, false };
+            conv.threads = threads;
+            conv.pool = &pool;
+            conv.convert_file();
+        } catch (std::exception const& e) {
+            test::check(false, "converting with " + std::to_string(threads) + " threads: " + e.what());
+        }
+        outputs.push_back(test::read_file(dir / "Ambiguous.nx"));
+    }
+    test::check(!outputs[0].empty(), "output written");
+    test::check(outputs[0].find("Max") != std::string::npos, "second img read with the later key");
+    test::check(outputs[0] == outputs[1], "same output for 1 and 4 threads");
+    return test::result();
+}
@@ -0,0 +1,64 @@
+// Patching the old NX with the delta between it and a new NX has to give the new NX byte for
+// byte, extension sections included, and deltas applied to the wrong file or cut short have to
+// be turned down.
+#include "test.h"
+
+int main()
+{
+    test::scratch dir { "delta" };
+    auto gms = &::Key::get(::Key::gms_iv);
+    auto old_wz = test::wz(gms,
+        { { "Map.img", test::img(gms, { { "info", test::integer(1) }, { "name", test::text(gms, "Henesys") } }) },
+            { "Mob.img", test::img(gms, { { "hp", test::integer(100) }, { "speed", test::integer(-20) } }) } });
+    // One value changed, one property and one img added
+    auto new_wz = test::wz(gms,
+        { { "Map.img", test::img(gms, { { "info", test::integer(2) }, { "name", test::text(gms, "Henesys") } }) },
+            { "Mob.img",
+                test::img(gms, { { "hp", test::integer(100) }, { "speed", test::integer(-20) },
+                                   { "pos", test::vector(gms, 3, -4) } }) },
+            { "Npc.img", test::img(gms, { { "name", test::text(gms, "Rina") } }) } });
+    test::write_file(dir / "Old.wz", old_wz);
+    test::write_file(dir / "New.wz", new_wz);
+    std::ostringstream quiet;
+    nl::progress = &quiet;
+    auto convert = [&](std::string const& name, bool extensions) {
+        nl::wztonx conv { dir / (name + ".wz"), false, false };
+        conv.child_index = extensions;
+        conv.string_hash_section = extensions;
+        conv.layout = extensions;
+        conv.convert_file();
+    };
+    for (auto extensions : { false, true }) {
+        auto what = std::string { extensions ? "with" : "without" } + " extension sections";
+        try {
+            convert("Old", extensions);
+            convert("New", extensions);
+            nl::nxdelta {}.diff(dir / "Old.nx", dir / "New.nx", dir / "Delta.nxd");
+            nl::nxdelta {}.patch(dir / "Old.nx", dir / "Delta.nxd", dir / "Patched.nx");
+        } catch (std::exception const& e) {
+            test::check(false, "round trip " + what + ": " + e.what());
+        }
+        auto expected = test::read_file(dir / "New.nx");
+        test::check(!expected.empty(), "output written " + what);
+        test::check(extensions == (expected.size() > 56 && expected.compare(52, 4, "NXX1") == 0),
+            "extension directory " + what);
+        test::check(test::read_file(dir / "Patched.nx") == expected, "patched NX is the new NX " + what);
+        sys::remove(dir / "Patched.nx");
+    }
+    // The expected failure, or a description of what happened instead
+    auto patch_error = [&](std::string const& old_nx, std::string const& delta) {
+        try {
+            nl::nxdelta {}.patch(old_nx, delta, dir / "Patched.nx");
+        } catch (std::runtime_error const& e) {
+            return std::string { e.what() };
+        }
+        return std::string { "no error" };
+    };
+    auto wrong = patch_error(dir / "New.nx", dir / "Delta.nxd");
+    test::check(wrong.find("was not made from") != std::string::npos, "patching the wrong file: " + wrong);
+    auto delta = test::read_file(dir / "Delta.nxd");
+    test::write_file(dir / "Cut.nxd", delta.substr(0, delta.size() - 16));
+    auto cut = patch_error(dir / "Old.nx", dir / "Cut.nxd");
+    test::check(cut.find("Truncated delta") != std::string::npos, "patching with a delta cut short: " + cut);
+    return test::result();
+}
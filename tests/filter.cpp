@@ -0,0 +1,85 @@
+// What survives --include and --exclude: excludes drop what they match and everything below it,
+// includes keep what they match, what is below it and the nodes on the way to it, even when
+// nothing below those is kept. A UOL into a dropped subtree becomes an empty node and is
+// reported.
+#include "test.h"
+
+int main()
+{
+    test::scratch dir { "filter" };
+    auto gms = &::Key::get(::Key::gms_iv);
+    auto wz = test::wz(gms,
+        { { "A.img",
+              test::img(gms,
+                  { { "info", test::sub(gms, { { "hp", test::integer(1) }, { "speed", test::integer(2) } }) },
+                      { "stand", test::sub(gms, { { "0", test::integer(3) } }) }, { "y", test::integer(4) },
+                      { "ref", test::uol(gms, "stand") } }) },
+            { "B.img",
+                test::img(gms, { { "other", test::integer(5) }, { "y", test::sub(gms, { { "z", test::integer(6) } }) } }) },
+            { "C.img", test::img(gms, { { "other", test::integer(7) } }) },
+            { "Long.img", test::img(gms, { { "other", test::integer(8) } }) } });
+    test::write_file(dir / "Data.wz", wz);
+    std::ostringstream quiet;
+    nl::progress = &quiet;
+    using paths = std::set<std::string>;
+    // Every path in the output, with the type of the node it leads to
+    auto convert = [&](std::vector<std::string> const& include, std::vector<std::string> const& exclude,
+                       std::string* errors = nullptr) {
+        paths found;
+        std::ostringstream log;
+        auto cerr = std::cerr.rdbuf(log.rdbuf());
+        try {
+            nl::wztonx conv { dir / "Data.wz", false, false };
+            for (auto& p : include)
+                conv.filter.add(conv.filter.include, p);
+            for (auto& p : exclude)
+                conv.filter.add(conv.filter.exclude, p);
+            conv.convert_file();
+            nl::nxfile f;
+            f.open(dir / "Data.nx");
+            std::vector<std::pair<uint32_t, std::string>> stack { { 0, "" } };
+            while (!stack.empty()) {
+                auto top = stack.back();
+                stack.pop_back();
+                auto n = f.get_node(top.first);
+                if (top.first != 0)
+                    found.insert(top.second + ":" + std::to_string(static_cast<int>(n.data_type)));
+                for (auto i = 0u; i < n.num; ++i) {
+                    auto name = std::string { f.name(f.get_node(n.children + i).name) };
+                    stack.emplace_back(n.children + i, top.second.empty() ? name : top.second + "/" + name);
+                }
+            }
+        } catch (std::exception const& e) {
+            test::check(false, std::string { "converting: " } + e.what());
+        }
+        std::cerr.rdbuf(cerr);
+        if (errors)
+            *errors = log.str();
+        return found;
+    };
+    // Imgs the include can't match below still stay, empty
+    test::check(convert({ "*.img/y" }, {})
+            == paths { "A.img:0", "A.img/y:1", "B.img:0", "B.img/y:0", "B.img/y/z:1", "C.img:0", "Long.img:0" },
+        "*.img/y keeps every y and everything below it, and the imgs on the way");
+    test::check(convert({ "?.img/o*" }, {})
+            == paths { "A.img:0", "B.img:0", "B.img/other:1", "C.img:0", "C.img/other:1" },
+        "? and * match within a name, ? a single character");
+    test::check(convert({ "A.img" }, { "*/info" })
+            == paths { "A.img:0", "A.img/ref:0", "A.img/ref/0:1", "A.img/stand:0", "A.img/stand/0:1", "A.img/y:1" },
+        "excludes win over includes");
+    // An exclude only applies at its own depth and below, never to the nodes on the way
+    std::string errors;
+    auto excluded = convert({}, { "A.img/stand" }, &errors);
+    test::check(excluded.count("A.img:0") && excluded.count("A.img/info/hp:1") && excluded.count("A.img/y:1"),
+        "A.img/stand leaves the rest of A.img");
+    test::check(!excluded.count("A.img/stand:0") && !excluded.count("A.img/stand/0:1"), "A.img/stand is dropped");
+    test::check(excluded.count("A.img/ref:0") && !excluded.count("A.img/ref/0:1"),
+        "a UOL into what was dropped is an empty node");
+    test::check(errors.find("Failed to find UOL [stand], it points at what the filter dropped")
+            != std::string::npos,
+        "the UOL into what was dropped is reported");
+    // Without the filter the UOL resolves
+    auto all = convert({}, {});
+    test::check(all.count("A.img/ref/0:1") != 0, "the UOL resolves without a filter");
+    return test::result();
+}
@@ -0,0 +1,74 @@
+// An incremental conversion has to write the same bytes a full one does, whether it reuses what
+// the manifest of the last run says or not, and a manifest written with other options has to be
+// ignored.
+#include "test.h"
+
+std::string pixels(int width, int height, int seed)
+{
+    std::string s;
+    for (auto i = 0; i < width * height * 4; ++i)
+        s += static_cast<char>(i * seed + seed);
+    return s;
+}
+
+int main()
+{
+    test::scratch dir { "incremental" };
+    sys::create_directories(dir.dir / "full");
+    auto gms = &::Key::get(::Key::gms_iv);
+    auto mob = [&](int hp, int seed) {
+        return test::img(gms,
+            { { "hp", test::integer(hp) }, { "name", test::text(gms, "Snail") },
+                { "stand", test::sub(gms, { { "0", test::canvas(gms, 8, 4, pixels(8, 4, seed)) } }) } });
+    };
+    auto map = test::img(gms,
+        { { "info", test::sub(gms, { { "town", test::integer(1) } }) },
+            { "back", test::canvas(gms, 4, 4, pixels(4, 4, 7)) } });
+    auto before = test::wz(gms, { { "Map.img", map }, { "Mob.img", mob(15, 3) } });
+    // One img changed, the other one and its canvas can be reused
+    auto after = test::wz(gms, { { "Map.img", map }, { "Mob.img", mob(20, 5) } });
+    std::ostringstream quiet;
+    nl::progress = &quiet;
+    struct run {
+        std::string nx;
+        // Whether the manifest of the last run was used, and its canvases with it
+        bool reused;
+        bool blobs;
+    };
+    auto convert = [&](std::string const& wz, bool client, bool incremental) {
+        auto r = run { {}, false, false };
+        try {
+            nl::wztonx conv { wz, client, false };
+            conv.incremental = incremental;
+            conv.convert_file();
+            r.reused = !conv.previous.imgs.empty();
+            r.blobs = !conv.previous.blobs.empty();
+        } catch (std::exception const& e) {
+            test::check(false, "converting " + wz + ": " + e.what());
+        }
+        r.nx = test::read_file(sys::path { wz }.replace_extension(".nx").string());
+        return r;
+    };
+    // What a full conversion makes of the input, in a directory of its own with no manifest
+    auto full = [&](std::string const& data, bool client) {
+        test::write_file(dir / "full/Data.wz", data);
+        return convert(dir / "full/Data.wz", client, false).nx;
+    };
+    test::write_file(dir / "Data.wz", before);
+    auto first = convert(dir / "Data.wz", true, true);
+    test::check(!first.nx.empty(), "output written");
+    test::check(!first.reused, "nothing to reuse on the first run");
+    test::check(first.nx == full(before, true), "first incremental run is a full conversion");
+    auto unchanged = convert(dir / "Data.wz", true, true);
+    test::check(unchanged.reused, "unchanged input reuses the manifest");
+    test::check(unchanged.nx == first.nx, "same output for unchanged input");
+    test::write_file(dir / "Data.wz", after);
+    auto changed = convert(dir / "Data.wz", true, true);
+    test::check(changed.reused && changed.blobs, "changed input reuses the manifest and canvases");
+    test::check(changed.nx == full(after, true), "same output as a full conversion after an img changed");
+    // The manifest was written for client output
+    auto server = convert(dir / "Data.wz", false, true);
+    test::check(!server.reused, "manifest of a client run ignored by a server run");
+    test::check(server.nx == full(after, false), "same output as a full server conversion");
+    return test::result();
+}
@@ -0,0 +1,182 @@
+//////////////////////////////////////////////////////////////////////////////////
+//	This file is part of the continued NoLifeStory project						//
+//	Copyright (C) 2014-2020  Peter Atashian, Ryan Payton						//
+//																				//
+//	This program is free software: you can redistribute it and/or modify		//
+//	it under the terms of the GNU Affero General Public License as published by	//
+//	the Free Software Foundation, either version 3 of the License, or			//
+//	(at your option) any later version.											//
+//																				//
+//	This program is distributed in the hope that it will be useful,				//
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of				//
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the				//
+//	GNU Affero General Public License for more details.							//
+//																				//
+//	You should have received a copy of the GNU Affero General Public License	//
+//	along with this program.  If not, see <https://www.gnu.org/licenses/>.		//
+//////////////////////////////////////////////////////////////////////////////////
+
+// What the tests of src/old/wztonx.h share. Every test is a program of its own that builds the
+// WZ files it needs, and exits with 1 when a check failed.
+#pragma once
+
+#ifndef NL_NO_STD_FILESYSTEM
+#include <filesystem>
+// wztonx.h still names the filesystem library the way it was before C++17
+namespace std::experimental {
+namespace filesystem = std::filesystem;
+}
+#endif
+#define NL_NO_MAIN
+#include "../src/old/wztonx.h"
+
+namespace test {
+int failures = 0;
+void check(bool ok, std::string const& what)
+{
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+int result()
+{
+    if (failures == 0)
+        std::cout << "All passed" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
+// An empty directory of its own under the temporary directory, removed on the way out
+struct scratch {
+    sys::path dir;
+    explicit scratch(std::string const& name)
+    {
+        dir = sys::temp_directory_path() / (name + "-" + std::to_string(::getpid()));
+        sys::remove_all(dir);
+        sys::create_directories(dir);
+    }
+    ~scratch()
+    {
+        std::error_code ec;
+        sys::remove_all(dir, ec);
+    }
+    std::string operator/(std::string const& file) const { return u8string(dir / file); }
+};
+std::string read_file(std::string const& name)
+{
+    auto f = std::ifstream { name, std::ios::binary };
+    return { std::istreambuf_iterator<char> { f }, std::istreambuf_iterator<char> {} };
+}
+void write_file(std::string const& name, std::string const& data)
+{
+    auto f = std::ofstream { name, std::ios::binary };
+    f.write(data.data(), static_cast<std::streamsize>(data.size()));
+}
+std::string cint(int32_t v)
+{
+    if (v >= -127 && v <= 127)
+        return std::string(1, static_cast<char>(v));
+    std::string s(5, '\x80');
+    std::memcpy(&s[1], &v, 4);
+    return s;
+}
+// An 8-bit string the way the WZ files store them, encrypted with key
+std::string enc(::Key* key, std::string const& s)
+{
+    auto k = key->data(s.size());
+    auto out = std::string(1, static_cast<char>(-static_cast<int>(s.size())));
+    uint8_t mask = 0xAA;
+    for (auto i = size_t { 0 }; i < s.size(); ++i, ++mask)
+        out += static_cast<char>(static_cast<uint8_t>(s[i]) ^ k[i] ^ mask);
+    return out;
+}
+// A property as its name and what follows the name, see integer, wide, text and the others
+using prop = std::pair<std::string, std::string>;
+std::string integer(int32_t v)
+{
+    return '\x03' + cint(v);
+}
+// Stored as 64 bits unless it fits in a byte
+std::string wide(int64_t v)
+{
+    if (v >= -127 && v <= 127)
+        return "\x14" + std::string(1, static_cast<char>(v));
+    std::string s(9, '\x80');
+    std::memcpy(&s[1], &v, 8);
+    return '\x14' + s;
+}
+std::string text(::Key* key, std::string const& s)
+{
+    return "\x08" + std::string(1, '\0') + enc(key, s);
+}
+// The properties of an img or of a sub property, after the count
+std::string props(::Key* key, std::vector<prop> const& values)
+{
+    auto s = cint(static_cast<int32_t>(values.size()));
+    for (auto& v : values)
+        s += '\0' + enc(key, v.first) + v.second;
+    return s;
+}
+// Extended properties come with their size in front, and the name of their kind
+std::string extended(::Key* key, std::string const& kind, std::string const& body)
+{
+    auto s = '\x73' + enc(key, kind) + body;
+    auto size = static_cast<uint32_t>(s.size());
+    return '\x09' + std::string(reinterpret_cast<char const*>(&size), 4) + s;
+}
+std::string vector(::Key* key, int32_t x, int32_t y)
+{
+    return extended(key, "Shape2D#Vector2D", cint(x) + cint(y));
+}
+std::string uol(::Key* key, std::string const& target)
+{
+    return extended(key, "UOL", std::string(2, '\0') + enc(key, target));
+}
+// A canvas of 8888 pixels, deflated without finishing the stream like the WZ files have them
+std::string canvas(::Key* key, int32_t width, int32_t height, std::string const& pixels)
+{
+    std::string data(compressBound(static_cast<uLong>(pixels.size())) + 64, '\0');
+    z_stream strm = {};
+    deflateInit(&strm, Z_DEFAULT_COMPRESSION);
+    strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(pixels.data()));
+    strm.avail_in = static_cast<uInt>(pixels.size());
+    strm.next_out = reinterpret_cast<Bytef*>(&data[0]);
+    strm.avail_out = static_cast<uInt>(data.size());
+    deflate(&strm, Z_SYNC_FLUSH);
+    data.resize(strm.total_out);
+    deflateEnd(&strm);
+    auto length = static_cast<uint32_t>(data.size());
+    return extended(key, "Canvas",
+        std::string(2, '\0') + cint(width) + cint(height) + cint(2) + std::string(5, '\0')
+            + std::string(reinterpret_cast<char const*>(&length), 4) + '\0' + data);
+}
+std::string sub(::Key* key, std::vector<prop> const& values)
+{
+    return extended(key, "Property", std::string(2, '\0') + props(key, values));
+}
+std::string img(::Key* key, std::vector<prop> const& values)
+{
+    return "\x73" + enc(key, "Property") + std::string(2, '\0') + props(key, values);
+}
+// An img holding an integer property for each of values
+std::string img(::Key* key, std::vector<std::pair<std::string, int32_t>> const& values)
+{
+    std::vector<prop> p;
+    for (auto& v : values)
+        p.emplace_back(v.first, integer(v.second));
+    return img(key, p);
+}
+// A WZ file with every img right under the root, the names encrypted with key
+std::string wz(::Key* key, std::vector<std::pair<std::string, std::string>> const& imgs)
+{
+    uint32_t const file_start = 60;
+    auto s = std::string { "PKG1" } + std::string(8, '\0');
+    s.append(reinterpret_cast<char const*>(&file_start), 4);
+    s.resize(file_start);
+    s += std::string { "\x53\x00", 2 } + cint(static_cast<int32_t>(imgs.size()));
+    for (auto& i : imgs)
+        s += '\x04' + enc(key, i.first) + cint(static_cast<int32_t>(i.second.size())) + cint(0) + std::string(4, '\0');
+    for (auto& i : imgs)
+        s += i.second;
+    return s;
+}
+}
@@ -0,0 +1,36 @@
+// A download cut short has to be reported as malformed input, with the offset it ends at, and
+// never as some other failure.
+#include "test.h"
+
+int main()
+{
+    test::scratch dir { "truncated" };
+    auto gms = &::Key::get(::Key::gms_iv);
+    auto wz = test::wz(gms, { { "Alone.img", test::img(gms, { { "info", 1 }, { "name", 2 } }) } });
+    std::ostringstream quiet;
+    nl::progress = &quiet;
+    // Right after the directory header, before the name of the first entry is complete
+    test::write_file(dir / "Cut.wz", wz.substr(0, 70));
+    try {
+        nl::wztonx conv { dir / "Cut.wz", true, false };
+        conv.convert_file();
+        test::check(false, "converting a WZ cut after its directory header succeeded");
+    } catch (nl::wz_error const& e) {
+        test::check(std::string { e.what() }.find("No string to identify the key by") != std::string::npos,
+            std::string { "error for a WZ cut after its directory header: " } + e.what());
+    } catch (std::exception const& e) {
+        test::check(false, std::string { "WZ cut after its directory header failed without a wz_error: " } + e.what());
+    }
+    // Anywhere else, either the part that is there converts or the cut is reported
+    for (auto size = size_t { 60 }; size < wz.size(); ++size) {
+        test::write_file(dir / "Cut.wz", wz.substr(0, size));
+        try {
+            nl::wztonx conv { dir / "Cut.wz", true, false };
+            conv.convert_file();
+        } catch (nl::wz_error const&) {
+        } catch (std::exception const& e) {
+            test::check(false, "WZ cut at " + std::to_string(size) + " failed without a wz_error: " + e.what());
+        }
+    }
+    return test::result();
+}
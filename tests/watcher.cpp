@@ -0,0 +1,23 @@
+// --watch a.wz has to notice a.wz changing, although the events name it ./a.wz.
+#include "test.h"
+
+int main()
+{
+#ifdef __linux__
+    test::scratch dir { "watcher" };
+    test::write_file(dir / "a.wz", "before");
+    sys::current_path(dir.dir);
+    nl::watcher w;
+    w.add("a.wz");
+    test::write_file("a.wz", "after");
+    // A missed change leaves wait() blocking for good
+    alarm(30);
+    auto changed = w.wait();
+    alarm(0);
+    test::check(changed.size() == 1, "one change");
+    test::check(!changed.empty() && sys::equivalent(changed[0], dir / "a.wz"), "the change is a.wz");
+#else
+    std::cout << "Watching needs inotify, skipped" << std::endl;
+#endif
+    return test::result();
+}
@@ -0,0 +1,27 @@
+// A standalone img read through windows has to come out the same as when it is mapped whole.
+// Its first read is inside the region img() enters, before any window is mapped.
+#include "test.h"
+
+int main()
+{
+    test::scratch dir { "windowed_img" };
+    auto gms = &::Key::get(::Key::gms_iv);
+    test::write_file(dir / "Alone.img", test::img(gms, { { "info", 1 }, { "name", 2 } }));
+    std::ostringstream quiet;
+    nl::progress = &quiet;
+    std::vector<std::string> outputs;
+    for (auto memory : { size_t { 0 }, size_t { 16 } << 20 }) {
+        try {
+            nl::imgtonx conv { dir / "Alone.img", true, false };
+            conv.memory = memory;
+            conv.convert_file();
+        } catch (std::exception const& e) {
+            test::check(false, "converting with a budget of " + std::to_string(memory) + ": " + e.what());
+        }
+        outputs.push_back(test::read_file(dir / "Alone.nx"));
+        sys::remove(dir / "Alone.nx");
+    }
+    test::check(!outputs[0].empty(), "output written");
+    test::check(outputs[0] == outputs[1], "same output mapped whole and through windows");
+    return test::result();
+}